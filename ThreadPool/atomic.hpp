@@ -86,6 +86,9 @@ GK_ATOMIC_DEFINE(8, __int64, _InterlockedExchangeAdd64,
 			return msfunc(reinterpret_cast<itype volatile*>(ptr), bit); \
 		}
 
+// Sequentially consistent fence
+GK_ALWAYS_INLINE void atomic_fence() { MemoryBarrier(); }
+
 GK_ATOMIC_BTS(4, bts, long, _interlockedbittestandset)
 GK_ATOMIC_BTS(4, btr, long, _interlockedbittestandreset)
 GK_ATOMIC_BTS(8, bts, __int64, _interlockedbittestandset64)
@@ -158,6 +161,9 @@ GK_ATOMIC_DEFINE(8, uint64_t)
 			return old & mask;                                                   \
 		}
 
+// Sequentially consistent fence
+GK_ALWAYS_INLINE void atomic_fence() { __atomic_thread_fence(__ATOMIC_SEQ_CST); }
+
 GK_ATOMIC_BTS(4, uint32_t, , bts, or)
 GK_ATOMIC_BTS(8, uint64_t, , bts, or)
 GK_ATOMIC_BTS(4, uint32_t, ~, btr, and)
@@ -0,0 +1,149 @@
+﻿#pragma once
+
+#include "parallel.hpp"
+
+#if defined __cpp_impl_coroutine
+#	include <coroutine>
+
+namespace gk {
+
+/* Resumes a coroutine on a thread of the pool */
+struct AsyncResume : public PooledAsyncJob<AsyncResume> {
+	std::coroutine_handle<> handle;
+
+	void call() override { handle.resume(); }
+};
+
+/* co_await pool.schedule()
+
+Continues the coroutine on a thread of the pool, queued as a job.
+With no background thread, it continues at once.
+*/
+struct AsyncSchedule {
+	AsyncPool* pool;
+
+	bool await_ready() const noexcept { return pool->getNumThread() < 1; }
+	void await_suspend(std::coroutine_handle<> handle)
+	{
+		RefPtr<AsyncResume> job = AsyncResume::make();
+		job->handle = handle;
+		pool->submit(RefPtr<AsyncJob>(std::move(job)));
+	}
+	void await_resume() const noexcept { }
+};
+
+inline AsyncSchedule AsyncPool::schedule() { return AsyncSchedule {this}; }
+
+/* co_await job
+
+Continues the coroutine when the job is completed, on the thread
+completing it, without blocking a thread meanwhile.
+*/
+struct JobAwaitable : public AsyncJob::Awaiter {
+	AsyncJob& job;
+	std::coroutine_handle<> handle;
+
+	explicit JobAwaitable(AsyncJob& jb) : job(jb) { }
+
+	bool await_ready() const noexcept { return !job.event.load(); }
+	void await_suspend(std::coroutine_handle<> hdl)
+	{
+		handle = hdl;
+		resume = [](AsyncJob::Awaiter* self) {
+			static_cast<JobAwaitable*>(self)->handle.resume();
+		};
+		job.await(this);
+	}
+	void await_resume() const noexcept { }
+};
+
+inline JobAwaitable operator co_await(AsyncJob& job) { return JobAwaitable(job); }
+
+/* Coroutine of AsyncPool, started at once on the calling thread
+
+	AsyncTask render(AsyncPool& pool, RefPtr<AsyncJob> shade)
+	{
+		co_await pool.schedule();
+		pool.submit(shade, 4);
+		co_await *shade;
+	}
+
+Completed as an AsyncJob that is not submitted, so `co_await task`
+and `task.wait()` works as for jobs. Frames come from FramePool.
+The frame is freed when both the coroutine and AsyncTask are done.
+*/
+class AsyncTask {
+public:
+	struct promise_type {
+		// Entered until the coroutine returns
+		struct State : public AsyncJob {
+			void call() override { }
+		} state;
+		// The coroutine and AsyncTask
+		uint32_t owners = 2;
+
+		static void* operator new(size_t size) { return FramePool::alloc(size); }
+		static void operator delete(void* ptr, size_t size) { FramePool::free(ptr, size); }
+
+		promise_type() { state.event.enter(); }
+		AsyncTask get_return_object()
+		{
+			return AsyncTask(std::coroutine_handle<promise_type>::from_promise(*this));
+		}
+		std::suspend_never initial_suspend() noexcept { return {}; }
+		auto final_suspend() noexcept
+		{
+			struct Final {
+				bool await_ready() const noexcept { return false; }
+				void await_suspend(std::coroutine_handle<promise_type> handle) noexcept
+				{
+					promise_type& promise = handle.promise();
+					promise.state.leave();
+					if (atomic_fetch_add(&(promise.owners), -1) == 1)
+						handle.destroy();
+				}
+				void await_resume() const noexcept { }
+			};
+			return Final {};
+		}
+		void return_void() { }
+		void unhandled_exception() { GK_LOG_ERROR("exception in coroutine\n"); }
+	};
+
+	AsyncTask(AsyncTask&& other) noexcept : handle(other.handle) { other.handle = nullptr; }
+	AsyncTask& operator=(AsyncTask&& other) noexcept
+	{
+		if (this != &other) {
+			release();
+			handle = other.handle;
+			other.handle = nullptr;
+		}
+		return *this;
+	}
+	~AsyncTask() { release(); }
+
+	bool done() const { return !handle.promise().state.event.load(); }
+	// Blocking, or doing jobs meanwhile on a background thread
+	void wait() { handle.promise().state.wait(); }
+	// Waiting, doing jobs of pool meanwhile
+	void wait(AsyncPool& pool) { pool.wait(handle.promise().state.event); }
+	JobAwaitable operator co_await() { return JobAwaitable(handle.promise().state); }
+
+private:
+	std::coroutine_handle<promise_type> handle;
+
+	explicit AsyncTask(std::coroutine_handle<promise_type> hdl) : handle(hdl) { }
+	AsyncTask(AsyncTask const&) = delete;
+	AsyncTask& operator=(AsyncTask const&) = delete;
+
+	void release()
+	{
+		if (handle && atomic_fetch_add(&(handle.promise().owners), -1) == 1)
+			handle.destroy();
+		handle = nullptr;
+	}
+};
+
+}
+
+#endif
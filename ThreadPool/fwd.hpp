@@ -215,3 +215,33 @@ GK_NO_RETURN void logError(char const* file, char const* func, int line,
 	do {                                        \
 		if (!(expr)) GK_LOG_ERROR("%s\n", #expr); \
 	} while (0)
+
+namespace gk {
+
+/* size bytes aligned to align, a power of 2, freed by alignedFree.
+  For over-aligned types, as new is not aligned before C++17 */
+GK_INLINE void* alignedAlloc(size_t size, size_t align)
+{
+	align = max(align, sizeof(void*));
+#if defined _WIN32
+	void* ptr = _aligned_malloc(size, align);
+#else
+	void* ptr = nullptr;
+	if (posix_memalign(&ptr, align, size))
+		ptr = nullptr;
+#endif
+	if (!ptr)
+		GK_LOG_ERROR("can not allocate %zu bytes aligned to %zu\n", size, align);
+	return ptr;
+}
+
+GK_INLINE void alignedFree(void* ptr)
+{
+#if defined _WIN32
+	_aligned_free(ptr);
+#else
+	free(ptr);
+#endif
+}
+
+}
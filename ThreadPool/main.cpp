@@ -1,10 +1,84 @@
 ﻿#include <ctime>
 #include <cmath>
+#include <numeric>
+#include <new>
 #include "parallel.hpp"
+#include "coroutine.hpp"
 using namespace gk;
 
 static int sCount = 0;
 
+/* Allocations of new, to check a steady state allocates nothing
+  All forms are replaced, so each delete frees as its new allocated */
+static uint32_t sNumAlloc = 0;
+
+static void* allocate(size_t size)
+{
+	atomic_fetch_add(&sNumAlloc, 1u);
+	return malloc(size ? size : 1);
+}
+
+GK_NO_INLINE void* operator new(size_t size)
+{
+	if (void* ptr = allocate(size))
+		return ptr;
+	throw std::bad_alloc();
+}
+
+GK_NO_INLINE void* operator new[](size_t size) { return operator new(size); }
+GK_NO_INLINE void* operator new(size_t size, std::nothrow_t const&) noexcept { return allocate(size); }
+GK_NO_INLINE void* operator new[](size_t size, std::nothrow_t const&) noexcept { return allocate(size); }
+GK_NO_INLINE void operator delete(void* ptr) noexcept { free(ptr); }
+GK_NO_INLINE void operator delete[](void* ptr) noexcept { free(ptr); }
+GK_NO_INLINE void operator delete(void* ptr, size_t) noexcept { free(ptr); }
+GK_NO_INLINE void operator delete[](void* ptr, size_t) noexcept { free(ptr); }
+GK_NO_INLINE void operator delete(void* ptr, std::nothrow_t const&) noexcept { free(ptr); }
+GK_NO_INLINE void operator delete[](void* ptr, std::nothrow_t const&) noexcept { free(ptr); }
+
+#if defined __cpp_aligned_new
+
+static void* allocate(size_t size, std::align_val_t align)
+{
+	atomic_fetch_add(&sNumAlloc, 1u);
+	size_t bound = max(static_cast<size_t>(align), sizeof(void*));
+#if defined _WIN32
+	return _aligned_malloc(size ? size : 1, bound);
+#elif defined __linux__
+	void* ptr = nullptr;
+	return posix_memalign(&ptr, bound, size ? size : 1) ? nullptr : ptr;
+#endif
+}
+
+static void release(void* ptr)
+{
+#if defined _WIN32
+	_aligned_free(ptr);
+#elif defined __linux__
+	free(ptr);
+#endif
+}
+
+GK_NO_INLINE void* operator new(size_t size, std::align_val_t align)
+{
+	if (void* ptr = allocate(size, align))
+		return ptr;
+	throw std::bad_alloc();
+}
+
+GK_NO_INLINE void* operator new[](size_t size, std::align_val_t align) { return operator new(size, align); }
+GK_NO_INLINE void* operator new(size_t size, std::align_val_t align, std::nothrow_t const&) noexcept
+	{ return allocate(size, align); }
+GK_NO_INLINE void* operator new[](size_t size, std::align_val_t align, std::nothrow_t const&) noexcept
+	{ return allocate(size, align); }
+GK_NO_INLINE void operator delete(void* ptr, std::align_val_t) noexcept { release(ptr); }
+GK_NO_INLINE void operator delete[](void* ptr, std::align_val_t) noexcept { release(ptr); }
+GK_NO_INLINE void operator delete(void* ptr, size_t, std::align_val_t) noexcept { release(ptr); }
+GK_NO_INLINE void operator delete[](void* ptr, size_t, std::align_val_t) noexcept { release(ptr); }
+GK_NO_INLINE void operator delete(void* ptr, std::align_val_t, std::nothrow_t const&) noexcept { release(ptr); }
+GK_NO_INLINE void operator delete[](void* ptr, std::align_val_t, std::nothrow_t const&) noexcept { release(ptr); }
+
+#endif
+
 struct Mat {
 	uint8_t* data;
 	int rows, cols;
@@ -31,14 +105,16 @@ struct Mat {
 	}
 };
 
-static void draw_mandelbrot(Mat& m,
-	double x0, double y0, double ppi, int start, int stop)
+static void draw_mandelbrot(Mat& m, double x0, double y0, double ppi,
+	int start, int stop, int left = 0, int right = -1)
 {
 	int const iteration = 300;
+	if (right < 0)
+		right = m.cols;
 	for (int h = start; h < stop; ++h) {
 		uint8_t* M = m.data + h * m.cols;
 		double Y0 = y0 + h * ppi;
-		for (int w = 0; w < m.cols; ++w) {
+		for (int w = left; w < right; ++w) {
 			double X0 = x0 + w * ppi;
 			double x = 0, y = 0, t;
 			double z = x * x + y * y;
@@ -82,9 +158,14 @@ class MbSync : public SyncJob {
 	double x0, y0, ppi;
 
 public:
-	MbSync(int rows, int cols, double ox, double oy, double radius)
+	// If touch, pages of the image are placed by it before drawing
+	MbSync(int rows, int cols, double ox, double oy, double radius,
+		Schedule sched = sched_dynamic, SyncPool* touch = nullptr)
 		: m(rows, cols), frame(++sCount)
 	{
+		if (touch)
+			touch->firstTouch(m.data, static_cast<uint32_t>(m.rows * m.cols), uint8_t(0));
+		schedule = sched;
 		allstart = 0;
 		allend = m.rows;
 		ppi = 2 * radius / min(m.rows, m.cols);
@@ -100,6 +181,478 @@ public:
 	}
 };
 
+// Same to MbSync, but by tiles
+class MbTile : public SyncJob2D {
+	Mat m;
+	int frame;
+	double x0, y0, ppi;
+
+public:
+	MbTile(int r, int c, double ox, double oy, double radius, Order ord)
+		: m(r, c), frame(++sCount)
+	{
+		rows = m.rows;
+		cols = m.cols;
+		order = ord;
+		ppi = 2 * radius / min(m.rows, m.cols);
+		x0 = ox - (m.cols - 1) * 0.5 * ppi;
+		y0 = oy - (m.rows - 1) * 0.5 * ppi;
+	}
+
+	~MbTile() { writePGM(m, frame); }
+
+	void call(uint32_t /* tid */,
+		uint32_t r0, uint32_t r1, uint32_t c0, uint32_t c1) override
+	{
+		draw_mandelbrot(m, x0, y0, ppi, r0, r1, c0, c1);
+	}
+};
+
+struct NopSync : public SyncJob {
+	void call(uint32_t, uint32_t, uint32_t) override { }
+};
+
+// Average microseconds of submitting an empty job to all threads
+static double forkSync(SyncPool& pool, bool lambda)
+{
+	int const count = 1000;
+	NopSync nop;
+	nop.allend = pool.getMaxThread();
+	int64_t t1 = getTickCount();
+	for (int i = count; i--;) {
+		if (lambda)
+			pool.parallel_for(0, pool.getMaxThread(), [](uint32_t, uint32_t, uint32_t) { });
+		else
+			pool.submit(nop);
+	}
+	return static_cast<double>(getTickCount() - t1) * 1e6 / getTickFrequency() / count;
+}
+
+// Same, with width threads at most, all of them if 0
+static double forkWidthSync(SyncPool& pool, uint32_t width)
+{
+	int const count = 1000;
+	NopSync nop;
+	nop.allend = pool.getMaxThread();
+	nop.maxcall = width;
+	int64_t t1 = getTickCount();
+	for (int i = count; i--;)
+		pool.submit(nop);
+	return static_cast<double>(getTickCount() - t1) * 1e6 / getTickFrequency() / count;
+}
+
+struct NopAsync : public AsyncJob {
+	void call() override { }
+};
+
+// Jobs not completed at once, JobEvent counts 65535 at most on Windows
+static int const sRound = 50000;
+
+// Submits jobs from a background thread, to its own deque
+struct FanAsync : public AsyncJob {
+	AsyncPool* pool;
+	std::vector<std::shared_ptr<AsyncJob>>* jobs;
+	int count;
+
+	void call() override
+	{
+		for (int i = 0; i < count; ++i)
+			pool->submit((*jobs)[i % jobs->size()]);
+	}
+};
+
+/* Empty jobs done per second, submitted by the main thread one by one
+  or in batches of 8, or by background threads */
+static double throughputAsync(AsyncPool& pool, bool nested, bool batch = false)
+{
+	int const count = 200000;
+	std::vector<std::shared_ptr<AsyncJob>> nops;
+	for (int i = 0; i < 8; ++i)
+		nops.push_back(std::make_shared<NopAsync>());
+	int nfan = static_cast<int>(max(pool.getNumThread(), 1u));
+	int done = 0;
+	int64_t t1 = getTickCount();
+	for (int round = 0; round < count; round += sRound) {
+		int n = min(sRound, count - round);
+		if (nested) {
+			for (int i = 0; i < nfan; ++i) {
+				auto fan = std::make_shared<FanAsync>();
+				fan->pool = &pool;
+				fan->jobs = &nops;
+				fan->count = n / nfan;
+				pool.submit(fan);
+			}
+			done += n / nfan * nfan;
+		} else if (batch) {
+			for (int i = 0; i < n; i += 8)
+				pool.submitBatch(nops.data(), 8);
+			done += n;
+		} else {
+			for (int i = 0; i < n; ++i)
+				pool.submit(nops[i % nops.size()]);
+			done += n;
+		}
+		pool.wait();
+	}
+	double elapse = static_cast<double>(getTickCount() - t1) / getTickFrequency();
+	return done / elapse;
+}
+
+struct PooledNopAsync : public PooledAsyncJob<PooledNopAsync> {
+	void call() override { }
+};
+
+// Submits new jobs from a background thread, shared_ptr or pooled RefPtr
+struct MakeAsync : public AsyncJob {
+	AsyncPool* pool;
+	bool pooled;
+	int count;
+
+	void call() override
+	{
+		for (int i = 0; i < count; ++i) {
+			if (pooled)
+				pool->submit(PooledNopAsync::make());
+			else
+				pool->submit(std::make_shared<NopAsync>());
+		}
+	}
+};
+
+// New empty jobs done per second, submitted by background threads
+static double allocAsync(AsyncPool& pool, bool pooled)
+{
+	int const count = 200000;
+	int nfan = static_cast<int>(max(pool.getNumThread(), 1u));
+	int done = 0;
+	int64_t t1 = getTickCount();
+	for (int round = 0; round < count; round += sRound) {
+		int n = min(sRound, count - round);
+		for (int i = 0; i < nfan; ++i) {
+			auto fan = std::make_shared<MakeAsync>();
+			fan->pool = &pool;
+			fan->pooled = pooled;
+			fan->count = n / nfan;
+			pool.submit(fan);
+		}
+		done += n / nfan * nfan;
+		pool.wait();
+	}
+	double elapse = static_cast<double>(getTickCount() - t1) / getTickFrequency();
+	return done / elapse;
+}
+
+/* New pooled jobs done per second, made and submitted by the main thread,
+  and allocations per job once freelists and queues are warm */
+static double externalAsync(AsyncPool& pool, double& allocs)
+{
+	int const count = 200000;
+	for (int i = 0; i < sRound; ++i)
+		pool.submit(PooledNopAsync::make());
+	pool.wait();
+	uint32_t nalloc = atomic_load(&sNumAlloc);
+	int64_t t1 = getTickCount();
+	for (int round = 0; round < count; round += sRound) {
+		for (int i = 0; i < sRound; ++i)
+			pool.submit(PooledNopAsync::make());
+		pool.wait();
+	}
+	double elapse = static_cast<double>(getTickCount() - t1) / getTickFrequency();
+	allocs = static_cast<double>(atomic_load(&sNumAlloc) - nalloc) / count;
+	return count / elapse;
+}
+
+// Futures with a continuation done per second, and the sum of their results
+static double futureAsync(AsyncPool& pool, uint64_t& sum)
+{
+	int const count = 100000, window = 64;
+	std::vector<JobFuture<uint64_t>> futures(window);
+	sum = 0;
+	int64_t t1 = getTickCount();
+	for (int i = 0; i < count; ++i) {
+		auto& future = futures[static_cast<size_t>(i % window)];
+		if (future.valid())
+			sum += future.get();
+		uint64_t v = static_cast<uint64_t>(i);
+		future = pool.async([v] { return v; }).then([](uint64_t& x) { return x * x; });
+	}
+	for (auto& future : futures)
+		sum += future.get();
+	double elapse = static_cast<double>(getTickCount() - t1) / getTickFrequency();
+	return count / elapse;
+}
+
+// Busy for some microseconds
+struct SpinAsync : public AsyncJob {
+	int64_t ticks;
+
+	void call() override
+	{
+		int64_t t1 = getTickCount();
+		while (getTickCount() - t1 < ticks)
+			yield(1);
+	}
+};
+
+// Waiting of each class, a flood of class 0 with a few jobs of higher classes
+static void priorityAsync(AsyncPool& pool)
+{
+	std::vector<std::shared_ptr<AsyncJob>> spins;
+	for (uint32_t c = 0; c < AsyncPool::NUM_CLASS; ++c) {
+		auto spin = std::make_shared<SpinAsync>();
+		spin->priority = c;
+		spin->ticks = static_cast<int64_t>(getTickFrequency() * 20e-6);
+		spins.push_back(spin);
+	}
+	pool.resetQueueStat();
+	for (int i = 0; i < 20000; ++i) {
+		pool.submit(spins[0]);
+		if (i % 100 == 0)
+			pool.submit(spins[1 + i / 100 % (AsyncPool::NUM_CLASS - 1)]);
+	}
+	pool.wait();
+	for (uint32_t c = 0; c < AsyncPool::NUM_CLASS; ++c) {
+		AsyncPool::QueueStat stat = pool.getQueueStat(c);
+		fprintf(stdout, "AsyncPool class %u jobs %6llu wait avg %10.1f us max %10.1f us\n",
+			c, static_cast<unsigned long long>(stat.count),
+			stat.count ? stat.wait_us / static_cast<double>(stat.count) : 0., stat.max_wait_us);
+	}
+}
+
+/* Layers of spinning jobs, each depends on two of the layer before.
+  Run as a graph, or layer by layer waiting from the main thread */
+static double graphAsync(AsyncPool& pool, bool graph)
+{
+	int const nlayer = 8, nrun = 50;
+	int const width = static_cast<int>(max(pool.getNumThread(), 1u)) * 2;
+	std::vector<std::shared_ptr<AsyncJob>> spins;
+	for (int i = 0; i < nlayer * width; ++i) {
+		auto spin = std::make_shared<SpinAsync>();
+		// Uneven, so that waiting whole layers leaves threads idle
+		spin->ticks = static_cast<int64_t>(getTickFrequency() * (i % 3 ? 20e-6 : 100e-6));
+		spins.push_back(spin);
+	}
+	JobGraph jobs;
+	for (auto& spin : spins)
+		jobs.add(spin);
+	for (int l = 1; l < nlayer; ++l) {
+		for (int i = 0; i < width; ++i) {
+			jobs.precede(static_cast<uint32_t>((l - 1) * width + i),
+				static_cast<uint32_t>(l * width + i));
+			jobs.precede(static_cast<uint32_t>((l - 1) * width + (i + 1) % width),
+				static_cast<uint32_t>(l * width + i));
+		}
+	}
+	int64_t t1 = getTickCount();
+	for (int r = 0; r < nrun; ++r) {
+		if (graph) {
+			jobs.run(pool);
+			jobs.wait();
+			continue;
+		}
+		for (int l = 0; l < nlayer; ++l) {
+			pool.submitBatch(&(spins[static_cast<size_t>(l * width)]), static_cast<uint32_t>(width));
+			pool.wait();
+		}
+	}
+	return static_cast<double>(getTickCount() - t1) * 1e3 / getTickFrequency() / nrun;
+}
+
+// Records how late it is called
+struct LateAsync : public AsyncJob {
+	int64_t due, late;
+
+	void call() override { late = getTickCount() - due; }
+};
+
+// Lateness of delayed jobs, with a periodic one meanwhile
+static void timerAsync(AsyncPool& pool)
+{
+	int const count = 2000;
+	double freq = getTickFrequency();
+	std::vector<std::shared_ptr<LateAsync>> jobs;
+	for (int i = 0; i < count; ++i) {
+		auto job = std::make_shared<LateAsync>();
+		uint32_t delay = static_cast<uint32_t>(i * 7 % 300);
+		job->due = getTickCount() + static_cast<int64_t>(delay * 1e-3 * freq);
+		pool.submitAfter(job, delay);
+		jobs.push_back(job);
+	}
+	auto tick = std::make_shared<NopAsync>();
+	uint64_t timer = pool.submitEvery(tick, 10);
+	Sleep(400);
+	pool.cancel(timer);
+	pool.wait();
+	double sum = 0, worst = 0;
+	for (auto& job : jobs) {
+		double late = static_cast<double>(job->late) * 1e3 / freq;
+		sum += late;
+		worst = max(worst, late);
+	}
+	fprintf(stdout, "AsyncPool timers %d late avg %6.3f ms max %6.3f ms\n",
+		count, sum / count, worst);
+}
+
+// Requests of a few stages, each submits a job and waits for it
+struct StageAsync : public PooledAsyncJob<StageAsync> {
+	int64_t ticks;
+
+	void call() override
+	{
+		int64_t t1 = getTickCount();
+		while (getTickCount() - t1 < ticks)
+			yield(1);
+	}
+};
+
+static int const sNumStage = 4;
+
+struct RequestAsync : public AsyncJob {
+	AsyncPool* pool;
+	int64_t ticks;
+
+	void call() override
+	{
+		for (int s = 0; s < sNumStage; ++s) {
+			RefPtr<StageAsync> stage = StageAsync::make();
+			stage->ticks = ticks;
+			pool->submit(RefPtr<AsyncJob>(stage));
+			// Blocks, or does other jobs meanwhile
+			stage->wait();
+		}
+	}
+};
+
+#if defined __cpp_impl_coroutine
+static AsyncTask requestCoro(AsyncPool& pool, int64_t ticks)
+{
+	co_await pool.schedule();
+	for (int s = 0; s < sNumStage; ++s) {
+		RefPtr<StageAsync> stage = StageAsync::make();
+		stage->ticks = ticks;
+		pool.submit(RefPtr<AsyncJob>(stage));
+		co_await *stage;
+	}
+}
+#endif
+
+// Requests done per second, by blocking waits or by coroutines
+static double requestAsync(AsyncPool& pool, bool coro)
+{
+	int const count = 2000;
+	int64_t ticks = static_cast<int64_t>(getTickFrequency() * 5e-6);
+	int64_t t1 = getTickCount();
+	if (coro) {
+#if defined __cpp_impl_coroutine
+		std::vector<AsyncTask> tasks;
+		for (int i = 0; i < count; ++i)
+			tasks.push_back(requestCoro(pool, ticks));
+		for (AsyncTask& task : tasks)
+			task.wait(pool);
+#else
+		return 0;
+#endif
+	} else {
+		std::vector<std::shared_ptr<AsyncJob>> requests;
+		for (int i = 0; i < count; ++i) {
+			auto request = std::make_shared<RequestAsync>();
+			request->pool = &pool;
+			request->ticks = ticks;
+			requests.push_back(request);
+		}
+		pool.submitBatch(requests.data(), count);
+		pool.wait();
+	}
+	double elapse = static_cast<double>(getTickCount() - t1) / getTickFrequency();
+	return count / elapse;
+}
+
+// Bursts of 1 ms jobs, threads follow the load in elastic mode
+static void elasticAsync(AsyncPool& pool)
+{
+	int64_t ms = static_cast<int64_t>(getTickFrequency() * 1e-3);
+	for (int burst = 0; burst < 3; ++burst) {
+		int64_t t1 = getTickCount();
+		uint32_t peak = 0;
+		for (int i = 0; i < 200; ++i) {
+			RefPtr<StageAsync> job = StageAsync::make();
+			job->ticks = ms;
+			pool.submit(RefPtr<AsyncJob>(std::move(job)));
+			peak = max(peak, pool.getNumThread());
+		}
+		pool.wait();
+		double elapse = static_cast<double>(getTickCount() - t1) * 1e3 / getTickFrequency();
+		Sleep(300);
+		fprintf(stdout, "AsyncPool elastic burst %d t %9.3f threads peak %2u, idle %2u\n",
+			burst, elapse, peak, pool.getNumThread());
+	}
+}
+
+/* Jobs of streams reading a table of their stream, summed per thread
+  by the index passed to call, so no lock. Tables stay in the caches of one core
+  if jobs of a stream go to one thread */
+struct StreamAsync : public PooledAsyncJob<StreamAsync> {
+	std::vector<float> const* table;
+	std::vector<double>* sums;
+
+	void call(uint32_t trd) override
+	{
+		double sum = 0;
+		for (float v : *table)
+			sum += v;
+		(*sums)[trd] += sum;
+	}
+};
+
+static double affineAsync(AsyncPool& pool, bool affine)
+{
+	uint32_t const nstream = 16, count = 4000;
+	std::vector<std::vector<float>> tables(nstream, std::vector<float>(1u << 16, 1.f));
+	std::vector<double> sums(pool.getMaxThread() + 1, 0);
+	uint32_t ntrd = max(pool.getNumThread(), 1u);
+	int64_t t1 = getTickCount();
+	for (uint32_t i = 0; i < count; ++i) {
+		RefPtr<StreamAsync> job = StreamAsync::make();
+		job->table = &(tables[i % nstream]);
+		job->sums = &sums;
+		if (affine)
+			pool.submitTo(i % nstream % ntrd, RefPtr<AsyncJob>(std::move(job)));
+		else
+			pool.submit(RefPtr<AsyncJob>(std::move(job)));
+	}
+	pool.wait();
+	double elapse = static_cast<double>(getTickCount() - t1) * 1e3 / getTickFrequency();
+	GK_ASSERT(std::accumulate(sums.begin(), sums.end(), 0.0) == 65536.0 * count);
+	return elapse;
+}
+
+/* Empty jobs done per second by a producer outrunning threads,
+  with queues bounded to 256 jobs: blocking, inline or trySubmit */
+static void boundedAsync(AsyncPool& pool)
+{
+	int const count = 200000;
+	auto nop = std::make_shared<NopAsync>();
+	char const* names[] = {"block", "inline", "try"};
+	for (int p = 0; p < 3; ++p) {
+		pool.setCapacity(256, p == 1 ? AsyncPool::overflow_inline : AsyncPool::overflow_block);
+		int rejected = 0;
+		int64_t t1 = getTickCount();
+		for (int i = 0; i < count; ++i) {
+			if (p < 2)
+				pool.submit(nop);
+			else if (!pool.trySubmit(nop))
+				++rejected;
+			if ((i + 1) % sRound == 0)
+				pool.wait();
+		}
+		pool.wait();
+		double elapse = static_cast<double>(getTickCount() - t1) / getTickFrequency();
+		fprintf(stdout, "AsyncPool bounded %-6s %10.0f /s, rejected %6d\n",
+			names[p], (count - rejected) / elapse, rejected);
+	}
+	pool.setCapacity(0);
+}
+
 class MbAsync : public AsyncJob {
 	Mat m;
 	int index, ntrd, frame;
@@ -148,21 +701,173 @@ int main()
 		for (int i = 0; i < nTRD; ++i) {
 			fprintf(stdout, " SyncPool set thread to %2d", TRD[i]);
 			pool.setNumThread(TRD[i]);
-			fprintf(stdout, " done\n");
+			fprintf(stdout, " done, fork %8.3f us, lambda %8.3f us\n",
+				forkSync(pool, false), forkSync(pool, true));
 			Sleep(100);
 		}
+		{
+			// Workers sleep between forks, all woken by one call, 2 by one too
+			uint32_t ncpu = static_cast<uint32_t>(CpuTopology::system().cpus.size());
+			SyncPool wide(max(ncpu, 16u));
+			for (uint32_t n = 2; n <= wide.getMaxThread(); n *= 2u) {
+				wide.setNumThread(n);
+				fprintf(stdout, " SyncPool fork cost %3u threads, all %8.3f us, 2 of them %8.3f us\n",
+					n, forkWidthSync(wide, 0), forkWidthSync(wide, 2));
+			}
+		}
+		pool.setSpinCount(1000);
 		for (int i = 0; i < 7; ++i) {
 			double x = -0.75, y = 0, r = 1.5;
 			if (i > 0)
 				x = X0, y = Y0, r = pow(0.2, i);
 			int64_t t1 = getTickCount();
-			MbSync mb(rows, cols, x, y, r);
-			pool.submit(mb);
-			double elapse = static_cast<double>(getTickCount() - t1) * ifreq;
+			{
+				MbSync mb(rows, cols, x, y, r);
+				pool.submit(mb);
+			}
+			int64_t t2 = getTickCount();
+			{
+				MbSync mb(rows, cols, x, y, r, SyncJob::sched_steal);
+				pool.submit(mb);
+			}
+			int64_t t3 = getTickCount();
+			{
+				MbTile mb(rows, cols, x, y, r, SyncJob2D::order_hilbert);
+				pool.submit(mb);
+			}
+			int64_t t4 = getTickCount();
+			{
+				MbSync mb(rows, cols, x, y, r, SyncJob::sched_auto);
+				pool.submit(mb);
+			}
+			int64_t t5 = getTickCount();
 			fprintf(stdout,
-				" SyncPool %d x % 9.6f y % 9.7f r %9.7f t %9.3f\n",
-				i, x, y, r, elapse);
+				" SyncPool %d x % 9.6f y % 9.7f r %9.7f t %9.3f steal %9.3f tile %9.3f auto %9.3f\n",
+				i, x, y, r, static_cast<double>(t2 - t1) * ifreq,
+				static_cast<double>(t3 - t2) * ifreq,
+				static_cast<double>(t4 - t3) * ifreq,
+				static_cast<double>(t5 - t4) * ifreq);
+		}
+		SyncPool::WaitStat stat = pool.getWaitStat();
+		fprintf(stdout, " SyncPool wait spin %llu sleep %llu\n",
+			static_cast<unsigned long long>(stat.spin),
+			static_cast<unsigned long long>(stat.sleep));
+		for (int det = 0; det < 2; ++det) {
+			int64_t t1 = getTickCount();
+			double sum = pool.reduce(1u, 100000000u, 0.0,
+				[](double& acc, uint32_t start, uint32_t end) {
+					for (uint32_t k = start; k < end; ++k)
+						acc += 1.0 / k;
+				},
+				[](double& acc, double const& other) { acc += other; }, det != 0);
+			double elapse = static_cast<double>(getTickCount() - t1) * ifreq;
+			fprintf(stdout, " SyncPool reduce deterministic %d sum %.17g t %9.3f\n",
+				det, sum, elapse);
+		}
+		{
+			uint32_t const len = 1u << 25;
+			std::vector<uint32_t> src(len), ser(len), par(len);
+			for (uint32_t k = 0; k < len; ++k)
+				src[k] = k & 255u;
+			int64_t t1 = getTickCount();
+			std::partial_sum(src.begin(), src.end(), ser.begin());
+			int64_t t2 = getTickCount();
+			pool.scan(src.data(), par.data(), len, 0u,
+				[](uint32_t a, uint32_t b) { return a + b; }, true);
+			int64_t t3 = getTickCount();
+			fprintf(stdout, " SyncPool scan %u partial_sum %9.3f scan %9.3f %s\n",
+				len, static_cast<double>(t2 - t1) * ifreq,
+				static_cast<double>(t3 - t2) * ifreq, ser == par ? "same" : "DIFFERENT");
+		}
+		{
+			// Sum of [0, n) mod 2^64, longer than UINT_MAX in one job
+			auto sumRange = [](uint64_t a, uint64_t b) {
+				return (b - a) % 2u ? (a + b - 1u) / 2u * (b - a) : (b - a) / 2u * (a + b - 1u);
+			};
+			uint64_t const len = 6000000000ull;
+			std::vector<uint64_t> sums(pool.getNumThread(), 0);
+			int64_t t1 = getTickCount();
+			pool.parallel_for64(0, len, [&](uint32_t tid, uint64_t start, uint64_t end) {
+				sums[tid] += sumRange(start, end);
+			});
+			double elapse = static_cast<double>(getTickCount() - t1) * ifreq;
+			uint64_t sum = std::accumulate(sums.begin(), sums.end(), static_cast<uint64_t>(0));
+			fprintf(stdout, " SyncPool range64 %llu t %9.3f %s\n",
+				static_cast<unsigned long long>(len), elapse,
+				sum == sumRange(0, len) ? "same" : "DIFFERENT");
+		}
+		for (uint32_t s = 0; s <= SyncJob::sched_auto; ++s) {
+			// Smoothing many times, as an iterative solver
+			uint32_t const len = 1u << 20;
+			std::vector<float> a(len, 1.f), b(len, 1.f);
+			int64_t t1 = getTickCount();
+			for (int it = 0; it < 100; ++it) {
+				pool.parallel_for(1, len - 1, [&](uint32_t, uint32_t start, uint32_t end) {
+					for (uint32_t k = start; k < end; ++k)
+						b[k] = (a[k - 1] + a[k] + a[k + 1]) * (1.f / 3.f);
+				}, static_cast<SyncJob::Schedule>(s));
+				a.swap(b);
+			}
+			double elapse = static_cast<double>(getTickCount() - t1) * ifreq;
+			fprintf(stdout, " SyncPool smooth schedule %u t %9.3f\n", s, elapse);
 		}
+		{
+			CpuTopology const& topo = CpuTopology::system();
+			fprintf(stdout, " SyncPool cpus %u cores %u packages %u\n",
+				static_cast<uint32_t>(topo.cpus.size()), topo.cpus.back().core + 1,
+				topo.cpus.back().package + 1);
+		}
+		for (uint32_t a = 0; a < CpuAffinity::affinity_list; ++a) {
+			// Static shares stay in the cache of one core only if threads stay
+			pool.setAffinity(static_cast<CpuAffinity::Policy>(a));
+			uint32_t const len = 1u << 20;
+			std::vector<float> u(len, 1.f), v(len, 1.f);
+			int64_t t1 = getTickCount();
+			for (int it = 0; it < 100; ++it) {
+				pool.parallel_for(1, len - 1, [&](uint32_t, uint32_t start, uint32_t end) {
+					for (uint32_t k = start; k < end; ++k)
+						v[k] = (u[k - 1] + u[k] + u[k + 1]) * (1.f / 3.f);
+				}, SyncJob::sched_static);
+				u.swap(v);
+			}
+			double elapse = static_cast<double>(getTickCount() - t1) * ifreq;
+			fprintf(stdout, " SyncPool smooth affinity %u t %9.3f\n", a, elapse);
+		}
+		pool.setAffinity(CpuAffinity::affinity_scatter);
+		for (int touch = 0; touch < 2; ++touch) {
+			// Pages on the node drawing them, matters on multi-socket only
+			int64_t t1 = getTickCount();
+			{
+				MbSync mb(rows, cols, -0.75, 0, 1.5, SyncJob::sched_static,
+					touch ? &pool : nullptr);
+				pool.submit(mb);
+			}
+			double elapse = static_cast<double>(getTickCount() - t1) * ifreq;
+			fprintf(stdout, " SyncPool first touch %d t %9.3f\n", touch, elapse);
+		}
+		{
+			// Scaling from 1 thread to one per CPU, doubling
+			uint32_t ncpu = static_cast<uint32_t>(CpuTopology::system().cpus.size());
+			double base = 0;
+			for (uint32_t n = 1;; n = min(n * 2u, ncpu)) {
+				pool.setNumThread(n);
+				// The main thread to the place after workers
+				pool.setAffinity(CpuAffinity::affinity_scatter);
+				int64_t t1 = getTickCount();
+				{
+					MbSync mb(rows, cols, X0, Y0, 0.2);
+					pool.submit(mb);
+				}
+				double elapse = static_cast<double>(getTickCount() - t1) * ifreq;
+				if (n == 1)
+					base = elapse;
+				fprintf(stdout, " SyncPool scaling %3u t %9.3f speedup %6.2f\n",
+					n, elapse, base / elapse);
+				if (n >= ncpu)
+					break;
+			}
+		}
+		pool.setAffinity(CpuAffinity::affinity_none);
 	}
 
 	{
@@ -185,6 +890,51 @@ int main()
 		fprintf(stdout, "AsyncPool %d t %9.3f\n", 7, elapse);
 	}
 
+	{
+		AsyncPool pool;
+		uint32_t ncpu = static_cast<uint32_t>(CpuTopology::system().cpus.size());
+		for (uint32_t n = 1;; n = min(n * 2u, ncpu)) {
+			pool.setNumThread(n);
+			fprintf(stdout, "AsyncPool empty jobs %3u threads, main %10.0f /s, batch %10.0f /s, nested %10.0f /s\n",
+				n, throughputAsync(pool, false), throughputAsync(pool, false, true),
+				throughputAsync(pool, true));
+			fprintf(stdout, "AsyncPool new jobs   %3u threads, shared %8.0f /s, pooled %8.0f /s\n",
+				n, allocAsync(pool, false), allocAsync(pool, true));
+			double allocs;
+			double made = externalAsync(pool, allocs);
+			fprintf(stdout, "AsyncPool main jobs  %3u threads, pooled %8.0f /s, allocations %.4f per job\n",
+				n, made, allocs);
+			uint64_t sum;
+			double rate = futureAsync(pool, sum);
+			fprintf(stdout, "AsyncPool futures    %3u threads, %10.0f /s, sum %llu\n",
+				n, rate, static_cast<unsigned long long>(sum));
+			if (n >= ncpu)
+				break;
+		}
+	}
+
+	{
+		AsyncPool pool;
+		pool.setNumThread(TRD[nTRD - 1]);
+		priorityAsync(pool);
+		timerAsync(pool);
+		fprintf(stdout, "AsyncPool requests, blocking %8.0f /s, coroutine %8.0f /s\n",
+			requestAsync(pool, false), requestAsync(pool, true));
+		fprintf(stdout, "AsyncPool dag per run, layers %8.3f ms, graph %8.3f ms\n",
+			graphAsync(pool, false), graphAsync(pool, true));
+	}
+
+	{
+		AsyncPool pool;
+		uint32_t const ncpu = static_cast<uint32_t>(CpuTopology::system().cpus.size());
+		pool.setElastic(AsyncPool::Elastic {0, max(ncpu, 4u), 100, 2, 1000});
+		elasticAsync(pool);
+		pool.setNumThread(TRD[nTRD - 1]);
+		boundedAsync(pool);
+		fprintf(stdout, "AsyncPool streams, any thread %8.3f ms, own thread %8.3f ms\n",
+			affineAsync(pool, false), affineAsync(pool, true));
+	}
+
 	{
 		AsyncPool pool;
 		int const ntrd = TRD[nTRD - 1];
@@ -196,13 +946,17 @@ int main()
 			int64_t t1 = getTickCount();
 			auto mb = std::make_shared<MbAsync>(ntrd, rows, cols, x, y, r);
 			// submit at least 1 times
-			for (int t = max(ntrd, 1); t--;)
-				pool.submit(mb);
-			mb->wait();
+			pool.submit(mb, static_cast<uint32_t>(max(ntrd, 1)));
+			// The main thread does shards too
+			pool.wait(*mb);
 			double elapse = static_cast<double>(getTickCount() - t1) * ifreq;
 			fprintf(stdout,
 				"AsyncPool %d x % 9.6f y % 9.7f r %9.7f t %9.3f\n",
 				i, x, y, r, elapse);
 		}
+		AsyncPool::WaitStat stat = pool.getWaitStat();
+		fprintf(stdout, "AsyncPool wait spin %llu sleep %llu\n",
+			static_cast<unsigned long long>(stat.spin),
+			static_cast<unsigned long long>(stat.sleep));
 	}
 }
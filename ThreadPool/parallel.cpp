@@ -5,11 +5,13 @@ namespace gk {
 
 #if defined _WIN32
 
-void JobEvent::wait(uint32_t desired)
+bool JobEvent::wait(uint32_t desired, uint32_t spin)
 {
 	/* Must do comparation and addition in one atomic operation
 	  Otherwise this thread maybe miss the wake signal and sleep forever */
 	uint32_t* address = &value;
+	for (; spin && (atomic_load(address) & mask_value) != desired; --spin)
+		yield(1);
 	uint32_t submit, val, old = atomic_load(address);
 	do {
 		submit = old & mask_value;
@@ -20,6 +22,7 @@ void JobEvent::wait(uint32_t desired)
 	if (submit != desired)
 		GK_ASSERT(NT_SUCCESS(
 			NtWaitForKeyedEvent(GlobalKeyedEventHandle(), address, FALSE, NULL)));
+	return submit != desired;
 }
 
 void JobEvent::wake()
@@ -38,104 +41,1437 @@ void JobEvent::wake()
 	}
 }
 
+bool JobEpoch::wait(uint32_t seen, uint32_t spin, uint32_t)
+{
+	// Same to JobEvent::wait, but waiting for a different value
+	uint32_t* address = &value;
+	for (; spin && (atomic_load(address) & mask_value) == seen; --spin)
+		yield(1);
+	uint32_t epoch, val, old = atomic_load(address);
+	do {
+		epoch = old & mask_value;
+		if (epoch != seen)
+			break;
+		val = old + one_sleep;
+	} while (!atomic_compare_exchange(address, &old, val));
+	if (epoch == seen)
+		GK_ASSERT(NT_SUCCESS(
+			NtWaitForKeyedEvent(GlobalKeyedEventHandle(), address, FALSE, NULL)));
+	return epoch == seen;
+}
+
+void JobEpoch::bump(uint32_t)
+{
+	uint32_t* address = &value;
+	uint32_t nsleep, val, old = atomic_load(address);
+	do {
+		nsleep = old & mask_sleep;
+		val = (old + 1u) & mask_value;
+	} while (!atomic_compare_exchange(address, &old, val));
+	for (; nsleep; nsleep -= one_sleep) {
+		GK_ASSERT(NT_SUCCESS(
+			NtReleaseKeyedEvent(GlobalKeyedEventHandle(), address, FALSE, NULL)));
+	}
+}
+
+#endif
+
+// CPU of the i-th thread, UINT_MAX for any
+static uint32_t placeOf(std::vector<uint32_t> const& places, uint32_t i)
+{
+	return places.empty() ? UINT_MAX : places[i % places.size()];
+}
+
+// Default number of threads at most
+static uint32_t maxThread(uint32_t n)
+{
+	if (n)
+		return n;
+	return max(static_cast<uint32_t>(CpuTopology::system().cpus.size()), 32u);
+}
+
+// Worker of AsyncPool running on this thread
+static thread_local void* sAsyncWorker = nullptr;
+// Its address tells threads apart
+static thread_local char sThreadTag;
+// Waits doing jobs on this thread, nested
+static thread_local uint32_t sHelpDepth = 0;
+// AsyncPool whose slot for other threads the running job holds
+static thread_local void* sSlotPool = nullptr;
+
+AsyncJob::AsyncJob()
+	: priority(0), node(NODE_ANY), worker(WORKER_ANY), awaiters(0), home(0) { }
+
+AsyncJob::~AsyncJob() { }
+
+void AsyncJob::call(uint32_t) { call(); }
+
+void AsyncJob::discard() { leave(); }
+
+void AsyncJob::await(Awaiter* awaiter)
+{
+	// Entering, so the job is not completed before it is pushed
+	event.enter();
+	uintptr_t head = atomic_load(&awaiters);
+	do {
+		awaiter->next = reinterpret_cast<Awaiter*>(head);
+	} while (!atomic_compare_exchange(&awaiters, &head, reinterpret_cast<uintptr_t>(awaiter)));
+	leave();
+}
+
+void AsyncJob::leave()
+{
+	if (event.leave() != 1)
+		return;
+	event.wake();
+	auto awaiter = reinterpret_cast<Awaiter*>(atomic_exchange(&awaiters, uintptr_t(0)));
+	while (awaiter) {
+		Awaiter* next = awaiter->next;
+		awaiter->resume(awaiter);
+		awaiter = next;
+	}
+}
+
+void AsyncJob::wait()
+{
+	// Only its own pool can take it out of queues
+	auto wk = static_cast<AsyncPool::Worker*>(sAsyncWorker);
+	uintptr_t pool = atomic_load(&home);
+	if (wk && reinterpret_cast<uintptr_t>(wk->pool) == pool)
+		wk->pool->help(event, this, wk);
+	else if (sSlotPool && reinterpret_cast<uintptr_t>(sSlotPool) == pool)
+		static_cast<AsyncPool*>(sSlotPool)->help(event, this, nullptr);
+	else
+		event.wait(0);
+}
+
+AsyncPool::Deque::Deque()
+	: top(0), bottom(0)
+{
+	rings.emplace_back(new Ring {63u, std::unique_ptr<uintptr_t[]>(new uintptr_t[64])});
+	ring = reinterpret_cast<uintptr_t>(rings.back().get());
+}
+
+void AsyncPool::Deque::push(uintptr_t item)
+{
+	uint32_t b = atomic_load(&bottom);
+	uint32_t t = atomic_load(&top);
+	Ring* r = reinterpret_cast<Ring*>(atomic_load(&ring));
+	if (b - t > r->mask) {
+		// Full, copy to a ring twice larger
+		uint32_t mask = r->mask * 2u + 1u;
+		GK_ASSERT(mask < (1u << 31));
+		rings.emplace_back(new Ring {mask, std::unique_ptr<uintptr_t[]>(new uintptr_t[mask + 1u])});
+		Ring* bigger = rings.back().get();
+		for (uint32_t i = t; i != b; ++i)
+			bigger->slots[i & mask] = r->slots[i & r->mask];
+		atomic_store(&ring, reinterpret_cast<uintptr_t>(bigger));
+		r = bigger;
+	}
+	atomic_store(&(r->slots[b & r->mask]), item);
+	atomic_store(&bottom, b + 1u);
+}
+
+uintptr_t AsyncPool::Deque::take()
+{
+	uint32_t b = atomic_load(&bottom) - 1u;
+	Ring* r = reinterpret_cast<Ring*>(atomic_load(&ring));
+	atomic_store(&bottom, b);
+	atomic_fence();
+	uint32_t t = atomic_load(&top);
+	int32_t size = static_cast<int32_t>(b - t);
+	if (size < 0) {
+		atomic_store(&bottom, b + 1u);
+		return 0;
+	}
+	uintptr_t item = atomic_load(&(r->slots[b & r->mask]));
+	if (size > 0)
+		return item;
+	// The last one, thieves may take it as well
+	if (!atomic_compare_exchange(&top, &t, t + 1u))
+		item = 0;
+	atomic_store(&bottom, b + 1u);
+	return item;
+}
+
+uintptr_t AsyncPool::Deque::steal()
+{
+	uint32_t t = atomic_load(&top);
+	atomic_fence();
+	uint32_t b = atomic_load(&bottom);
+	if (static_cast<int32_t>(b - t) <= 0)
+		return 0;
+	Ring* r = reinterpret_cast<Ring*>(atomic_load(&ring));
+	uintptr_t item = atomic_load(&(r->slots[t & r->mask]));
+	if (!atomic_compare_exchange(&top, &t, t + 1u))
+		return 0;
+	return item;
+}
+
+bool AsyncPool::Deque::empty() const
+{
+	uint32_t t = atomic_load(const_cast<uint32_t*>(&top));
+	uint32_t b = atomic_load(const_cast<uint32_t*>(&bottom));
+	return static_cast<int32_t>(b - t) <= 0;
+}
+
+AsyncPool::AsyncPool(uint32_t max_thrd)
+	: num_thread(0), max_thread(maxThread(max_thrd)), spin_count(64), current_id(0),
+		nidle(0), ninject(0), nurgent(0), num_node(0),
+		workers(max_thread), slot_owner(0), slot_depth(0), topo(CpuTopology::system())
+{
+	for (uint32_t i = max_thread; i--;) {
+		workers[i].index = i;
+		workers[i].stop = 0;
+		workers[i].node = AsyncJob::NODE_ANY;
+		workers[i].seed = i * 2654435761u + 1u;
+		workers[i].pool = this;
+		workers[i].thread = 0;
+		workers[i].joinable = false;
+		workers[i].active_ms = 0;
+		workers[i].sleeping = false;
+		workers[i].ninbox = 0;
+	}
+	resetWaitStat();
+	sleepers.reserve(max_thread);
+	timer_free = TIMER_NONE;
+	for (uint32_t& head : timer_head)
+		head = TIMER_NONE;
+	for (uint64_t& used : timer_used)
+		used = 0;
+	timer_now = timer_due = ntimer = 0;
+	keeper = UINT_MAX;
+	timer_base = getTickCount();
+	elastic = Elastic {0, 0, 0, 0, 0};
+	elastic_on = growing = last_wait_us = 0;
+	has_manager = manager_stop = false;
+	capacity = nblocked = 0;
+	overflow = overflow_block;
+	nprivate = 0;
+	steal_us = 1000;
+	steal_ticks = static_cast<int64_t>(getTickFrequency() * 1e-3);
+	num_node = topo.numNode();
+	waitlists.resize((num_node + 1) * NUM_CLASS);
+	for (uint32_t c = 0; c < NUM_CLASS; ++c) {
+		credits[c] = 1u << (2 * c);
+		stats[c].depth = 0;
+	}
+	resetQueueStat();
+}
+
+AsyncPool::~AsyncPool()
+{
+	setNumThread(0);
+	// No thread is to be started now
+	if (has_manager) {
+		work_lock.acquire();
+		manager_stop = true;
+		grow_cond.signal();
+		work_lock.release();
+#if defined _WIN32
+		WaitForSingleObject(reinterpret_cast<HANDLE>(manager), INFINITE);
+		CloseHandle(reinterpret_cast<HANDLE>(manager));
+#elif defined __linux__
+		pthread_join(manager, NULL);
+#endif
+	}
+	// Retired by elastic mode
+	for (uint32_t i = 0; i < max_thread; ++i)
+		joinThread(i);
+	// Discard unfinished jobs and pending timers
+	for (auto& list : waitlists) {
+		for (size_t i = 0; i < list.size(); ++i) {
+			list[i].job->discard();
+			event.leave();
+		}
+	}
+	waitlists.clear();
+	timers.clear();
+}
+
+void AsyncPool::setNumThread(uint32_t n)
+{
+	n = min(n, max_thread);
+	pool_lock.acquire();
+	// Threads stop retiring, and none is being started
+	work_lock.acquire();
+	atomic_store(&elastic_on, 0u);
+	work_lock.release();
+	while (atomic_load(&growing))
+		yield(1);
+	if (n < num_thread) {
+		// Stopped threads do jobs left in their deques first
+		work_lock.acquire();
+		for (uint32_t i = n; i < num_thread; ++i)
+			atomic_store(&(workers[i].stop), 1u);
+		wakeAll();
+		work_lock.release();
+		for (uint32_t i = n; i < num_thread; ++i)
+			joinThread(i);
+	}
+	for (uint32_t i = num_thread; i < n; ++i) {
+		joinThread(i);
+		startThread(i);
+	}
+	work_lock.acquire();
+	atomic_store(&num_thread, n);
+	work_lock.release();
+	// Producers waiting for room do jobs themselves without threads
+	if (!n)
+		space_cond.broadcast();
+	pool_lock.release();
+}
+
+void AsyncPool::setElastic(Elastic const& el)
+{
+	GK_ASSERT(el.min_thread <= el.max_thread);
+	setNumThread(min(max(getNumThread(), el.min_thread), min(el.max_thread, max_thread)));
+	pool_lock.acquire();
+	if (!has_manager) {
+		has_manager = true;
+#if defined _WIN32
+		manager = _beginthreadex(NULL, 0, mgrRoutine, this, 0, NULL);
+		if (manager == 0 || manager == static_cast<uintptr_t>(-1)) {
+			DWORD err = GetLastError();
+			GK_LOG_ERROR("manager can not create thread, "
+									 "handle = %llx, err = %u, errno %s\n",
+				manager, static_cast<unsigned>(err), strerror(errno));
+		}
+#elif defined __linux__
+		pthread_create(&manager, NULL, mgrRoutine, this);
+		pthread_setname_np(manager, "ATrdMgr");
+#endif
+	}
+	work_lock.acquire();
+	elastic = el;
+	elastic.max_thread = min(el.max_thread, max_thread);
+	atomic_store(&elastic_on, 1u);
+	// The thread to retire sleeps again with timeout
+	if (num_thread)
+		wake(workers[num_thread - 1]);
+	work_lock.release();
+	pool_lock.release();
+	if (needGrow())
+		grow();
+}
+
+void AsyncPool::joinThread(uint32_t i)
+{
+	if (!workers[i].joinable)
+		return;
+#if defined _WIN32
+	WaitForSingleObject(reinterpret_cast<HANDLE>(workers[i].thread), INFINITE);
+	CloseHandle(reinterpret_cast<HANDLE>(workers[i].thread));
+#elif defined __linux__
+	pthread_join(workers[i].thread, NULL);
+#endif
+	workers[i].thread = INT_MAX;
+	workers[i].joinable = false;
+	// Jobs left in the inbox are queued for others, as the thread is stopped
+	work_lock.acquire();
+	IdRing inbox;
+	std::swap(inbox, workers[i].inbox);
+	atomic_store(&nprivate, nprivate - static_cast<uint32_t>(inbox.size()));
+	atomic_store(&(workers[i].ninbox), 0u);
+	for (size_t k = 0; k < inbox.size(); ++k)
+		put(std::move(inbox[k]));
+	for (size_t k = inbox.size(); k-- && !sleepers.empty();)
+		wakeOne();
+	work_lock.release();
+}
+
+void AsyncPool::startThread(uint32_t i)
+{
+	workers[i].stop = 0;
+	workers[i].joinable = true;
+	workers[i].active_ms = timerClock();
+#if defined _WIN32
+	workers[i].thread = _beginthreadex(
+		NULL, 0, trdRoutine, &(workers[i]), 0, &(workers[i].win32_id));
+	if (workers[i].thread == 0
+		|| workers[i].thread == static_cast<uintptr_t>(-1)) {
+		DWORD err = GetLastError();
+		GK_LOG_ERROR("worker %d can not create thread, "
+								 "handle = %llx, err = %u, errno %s\n",
+			i, workers[i].thread, static_cast<unsigned>(err), strerror(errno));
+	}
+#elif defined __linux__
+	char info[16];
+	pthread_create(&(workers[i].thread), NULL, trdRoutine, &(workers[i]));
+	snprintf(info, sizeof(info), "ATrd%u", i);
+	pthread_setname_np(workers[i].thread, info);
 #endif
+	if (!places.empty() && !topo.fake)
+		pinThread(workers[i].thread, placeOf(places, i));
+}
+
+bool AsyncPool::needGrow()
+{
+	if (!atomic_load(&elastic_on) || atomic_load(&nidle))
+		return false;
+	uint32_t n = atomic_load(&num_thread);
+	uint32_t queued = atomic_load(&ninject);
+	return n < elastic.max_thread && queued
+		&& (n == 0 || queued >= elastic.depth * n || atomic_load(&last_wait_us) >= elastic.wait_us);
+}
+
+void AsyncPool::grow()
+{
+	// One at a time, others go on with their jobs
+	uint32_t busy = 0;
+	if (!atomic_compare_exchange(&growing, &busy, 1u))
+		return;
+	work_lock.acquire();
+	grow_cond.signal();
+	work_lock.release();
+}
+
+void AsyncPool::manage()
+{
+	work_lock.acquire();
+	while (true) {
+		while (!growing && !manager_stop)
+			grow_cond.wait(work_lock);
+		if (manager_stop)
+			break;
+		// Threads do not retire meanwhile, as growing is set
+		uint32_t i = num_thread;
+		bool start = elastic_on && i < elastic.max_thread;
+		work_lock.release();
+		if (start) {
+			joinThread(i);
+			// Places and topo are not changed meanwhile
+			work_lock.acquire();
+			startThread(i);
+			atomic_store(&num_thread, i + 1);
+			work_lock.release();
+		}
+		atomic_store(&growing, 0u);
+		work_lock.acquire();
+	}
+	work_lock.release();
+}
+
+#if defined _WIN32
+unsigned AsyncPool::mgrRoutine(void* void_args)
+#elif defined __linux__
+void* AsyncPool::mgrRoutine(void* void_args)
+#endif
+{
+	static_cast<AsyncPool*>(void_args)->manage();
+#if defined _WIN32
+	return 0;
+#elif defined __linux__
+	return nullptr;
+#endif
+}
+
+void AsyncPool::applyAffinity()
+{
+	bool pinned = !places.empty();
+	std::vector<uint32_t> placed = affinity.place(topo);
+	work_lock.acquire();
+	places = std::move(placed);
+	for (uint32_t i = 0; i < max_thread; ++i) {
+		uint32_t cpu = placeOf(places, i);
+		atomic_store(&(workers[i].node),
+			places.empty() ? static_cast<uint32_t>(AsyncJob::NODE_ANY) : topo.nodeOf(cpu));
+	}
+	work_lock.release();
+	if (topo.fake || (!pinned && places.empty()))
+		return;
+	for (uint32_t i = 0; i < num_thread; ++i)
+		pinThread(workers[i].thread, placeOf(places, i));
+}
+
+void AsyncPool::setAffinity(CpuAffinity const& aff)
+{
+	pool_lock.acquire();
+	affinity = aff;
+	applyAffinity();
+	pool_lock.release();
+}
+
+void AsyncPool::setTopology(CpuTopology const& topology)
+{
+	pool_lock.acquire();
+	// Queue again jobs waiting, by their new node
+	work_lock.acquire();
+	topo = topology;
+	std::vector<IdJob> jobs;
+	for (auto& list : waitlists) {
+		for (size_t i = 0; i < list.size(); ++i)
+			jobs.push_back(std::move(list[i]));
+	}
+	std::sort(jobs.begin(), jobs.end(), [](IdJob const& a, IdJob const& b) {
+		return static_cast<int32_t>(a.id - b.id) < 0;
+	});
+	num_node = topo.numNode();
+	waitlists.assign((num_node + 1) * NUM_CLASS, IdRing());
+	for (uint32_t c = 0; c < NUM_CLASS; ++c)
+		stats[c].depth = 0;
+	atomic_store(&ninject, 0u);
+	atomic_store(&nurgent, 0u);
+	for (IdJob& it : jobs)
+		put(std::move(it));
+	work_lock.release();
+	applyAffinity();
+	pool_lock.release();
+}
+
+uintptr_t AsyncPool::toItem(JobPtr job)
+{
+	if (job.ref) {
+		auto item = reinterpret_cast<uintptr_t>(job.ref.release());
+		GK_ASSERT(!(item & 1));
+		return item | 1;
+	}
+	return reinterpret_cast<uintptr_t>(new std::shared_ptr<AsyncJob>(std::move(job.shared)));
+}
+
+AsyncPool::JobPtr AsyncPool::fromItem(uintptr_t item)
+{
+	JobPtr job;
+	if (item & 1) {
+		job.ref = RefPtr<AsyncJob>::adopt(reinterpret_cast<AsyncJob*>(item & ~uintptr_t(1)));
+	} else {
+		std::unique_ptr<std::shared_ptr<AsyncJob>> box(
+			reinterpret_cast<std::shared_ptr<AsyncJob>*>(item));
+		job.shared = std::move(*box);
+	}
+	return job;
+}
+
+void AsyncPool::submit(std::shared_ptr<AsyncJob> job) { submit(std::move(job), 1); }
+
+void AsyncPool::submit(RefPtr<AsyncJob> job) { submit(std::move(job), 1); }
+
+void AsyncPool::submit(std::shared_ptr<AsyncJob> job, uint32_t times)
+{
+	JobPtr ptr;
+	ptr.shared = std::move(job);
+	submitTimes(ptr, times);
+}
+
+void AsyncPool::submit(RefPtr<AsyncJob> job, uint32_t times)
+{
+	JobPtr ptr;
+	ptr.ref = std::move(job);
+	submitTimes(ptr, times);
+}
+
+void AsyncPool::submitBatch(std::shared_ptr<AsyncJob> const* jobs, uint32_t count)
+{
+	if (inlined()) {
+		uint32_t index = getWorkerIndex();
+		for (uint32_t i = 0; i < count; ++i)
+			jobs[i]->call(index);
+		return;
+	}
+	for (uint32_t i = 0; i < count; ++i)
+		jobs[i]->event.enter();
+	submitJobs(count, [jobs](uint32_t i) {
+		JobPtr ptr;
+		ptr.shared = jobs[i];
+		return ptr;
+	});
+}
+
+void AsyncPool::submitBatch(RefPtr<AsyncJob> const* jobs, uint32_t count)
+{
+	if (inlined()) {
+		uint32_t index = getWorkerIndex();
+		for (uint32_t i = 0; i < count; ++i)
+			jobs[i]->call(index);
+		return;
+	}
+	for (uint32_t i = 0; i < count; ++i)
+		jobs[i]->event.enter();
+	submitJobs(count, [jobs](uint32_t i) {
+		JobPtr ptr;
+		ptr.ref = jobs[i];
+		return ptr;
+	});
+}
+
+void AsyncPool::submitTimes(JobPtr const& job, uint32_t times)
+{
+	if (inlined()) {
+		// Without threads, concurrent callers share the index, as in the job
+		uint32_t index = getWorkerIndex();
+		while (times--)
+			job->call(index);
+		return;
+	}
+	if (!times)
+		return;
+	job->event.enter(times);
+	submitJobs(times, [&job](uint32_t) { return job; });
+}
+
+void AsyncPool::submitTo(uint32_t wk, std::shared_ptr<AsyncJob> job)
+{
+	job->worker = wk;
+	submit(std::move(job));
+}
+
+void AsyncPool::submitTo(uint32_t wk, RefPtr<AsyncJob> job)
+{
+	job->worker = wk;
+	submit(std::move(job));
+}
+
+void AsyncPool::setStealDelay(uint32_t us)
+{
+	work_lock.acquire();
+	steal_us = us;
+	steal_ticks = us == UINT_MAX ? INT64_MAX : static_cast<int64_t>(us * 1e-6 * getTickFrequency());
+	// Sleeping until the old delay
+	if (keeper != UINT_MAX)
+		wake(workers[keeper]);
+	work_lock.release();
+}
+
+AsyncPool::WaitStat AsyncPool::getWaitStat() const
+{
+	WaitStat sum = wait_stat;
+	for (uint32_t i = max_thread; i--;) {
+		sum.spin += workers[i].stat.spin;
+		sum.sleep += workers[i].stat.sleep;
+	}
+	return sum;
+}
+
+void AsyncPool::resetWaitStat()
+{
+	wait_stat.spin = wait_stat.sleep = 0;
+	for (uint32_t i = max_thread; i--;)
+		workers[i].stat.spin = workers[i].stat.sleep = 0;
+}
+
+uint32_t AsyncPool::getWorkerIndex() const
+{
+	auto wk = static_cast<Worker*>(sAsyncWorker);
+	return wk && wk->pool == this ? wk->index : max_thread;
+}
+
+uint32_t AsyncPool::enterSlot()
+{
+	auto wk = static_cast<Worker*>(sAsyncWorker);
+	if (wk && wk->pool == this)
+		return wk->index;
+	auto self = reinterpret_cast<uintptr_t>(&sThreadTag);
+	uintptr_t owner = 0;
+	if (!atomic_compare_exchange(&slot_owner, &owner, self) && owner != self)
+		return UINT_MAX;
+	// Only the owner counts
+	++slot_depth;
+	return max_thread;
+}
+
+void AsyncPool::leaveSlot(uint32_t index)
+{
+	if (index == max_thread && !--slot_depth)
+		atomic_store(&slot_owner, uintptr_t(0));
+}
+
+void AsyncPool::setCapacity(uint32_t cap, Overflow over)
+{
+	work_lock.acquire();
+	capacity = cap;
+	overflow = over;
+	work_lock.release();
+	// Those waiting see the new bound
+	space_cond.broadcast();
+}
+
+bool AsyncPool::trySubmit(std::shared_ptr<AsyncJob> job)
+{
+	JobPtr ptr;
+	ptr.shared = std::move(job);
+	return trySubmitJob(std::move(ptr));
+}
+
+bool AsyncPool::trySubmit(RefPtr<AsyncJob> job)
+{
+	JobPtr ptr;
+	ptr.ref = std::move(job);
+	return trySubmitJob(std::move(ptr));
+}
+
+bool AsyncPool::trySubmitJob(JobPtr job)
+{
+	// Not queued in waitlists, never full
+	auto wk = static_cast<Worker*>(sAsyncWorker);
+	if (inlined()
+		|| (wk && wk->pool == this && !job->priority && job->worker == AsyncJob::WORKER_ANY)) {
+		submitTimes(job, 1);
+		return true;
+	}
+	work_lock.acquire();
+	bool hinted = toInbox(*job.get());
+	if (!hinted && full()) {
+		work_lock.release();
+		return false;
+	}
+	job->event.enter();
+	event.enter();
+	put(IdJob {current_id++, getTickCount(), std::move(job)});
+	// Those of inboxes are woken by put
+	if (!hinted)
+		wakeOne();
+	work_lock.release();
+	if (needGrow())
+		grow();
+	return true;
+}
+
+template <typename F>
+void AsyncPool::submitJobs(uint32_t count, F const& at)
+{
+	if (!count)
+		return;
+	event.enter(count);
+	auto wk = static_cast<Worker*>(sAsyncWorker);
+	bool nested = wk && wk->pool == this;
+	bool locked = false, pushed = false;
+	uint32_t nhinted = 0;
+	int64_t tick = 0;
+	for (uint32_t i = 0; i < count; ++i) {
+		JobPtr job = at(i);
+		if (nested && !job->priority && job->worker == AsyncJob::WORKER_ANY) {
+			atomic_store(&(job->home), reinterpret_cast<uintptr_t>(this));
+			wk->deque.push(toItem(std::move(job)));
+			pushed = true;
+			continue;
+		}
+		if (!locked) {
+			work_lock.acquire();
+			locked = true;
+			tick = getTickCount();
+		}
+		if (toInbox(*job.get())) {
+			++nhinted;
+		} else if (full()) {
+			// Jobs queued so far are taken meanwhile
+			wakeAll();
+			if (!nested && overflow == overflow_block) {
+				work_lock.release();
+				if (needGrow())
+					grow();
+				work_lock.acquire();
+				waitSpace();
+			}
+			if (full()) {
+				// Without threads, done here as inlined, otherwise with the slot if free
+				bool stall = stalled();
+				work_lock.release();
+				locked = false;
+				if (stall) {
+					run(job, getWorkerIndex());
+					continue;
+				}
+				uint32_t index = enterSlot();
+				if (index != UINT_MAX) {
+					run(job, index);
+					leaveSlot(index);
+					continue;
+				}
+				// The slot of threads out of the pool is held by another
+				work_lock.acquire();
+				locked = true;
+				waitSpace();
+			}
+			tick = getTickCount();
+		}
+		put(IdJob {current_id++, tick, std::move(job)});
+	}
+	if (pushed) {
+		// Pairs with the fence in idle, either we see it or it sees the job
+		atomic_fence();
+		if (!locked && atomic_load(&nidle)) {
+			work_lock.acquire();
+			locked = true;
+		}
+	}
+	if (locked) {
+		// Those of inboxes are woken by put
+		for (uint32_t n = count - nhinted; n-- && !sleepers.empty();)
+			wakeOne();
+		work_lock.release();
+	}
+	if (needGrow())
+		grow();
+}
+
+void AsyncPool::waitSpace()
+{
+	while (full() && !stalled()) {
+		++nblocked;
+		space_cond.wait(work_lock);
+		--nblocked;
+	}
+}
+
+void AsyncPool::put(IdJob it)
+{
+	atomic_store(&(it.job->home), reinterpret_cast<uintptr_t>(this));
+	if (toInbox(*it.job.get())) {
+		Worker& wk = workers[it.job->worker];
+		wk.inbox.push_back(std::move(it));
+		atomic_store(&(wk.ninbox), wk.ninbox + 1u);
+		atomic_store(&nprivate, nprivate + 1u);
+		// The thread of the inbox, or the keeper to let others take it after the delay
+		if (wk.sleeping)
+			wake(wk);
+		else if (steal_ticks != INT64_MAX && keeper == UINT_MAX)
+			wakeOne();
+		else if (steal_ticks != INT64_MAX && nprivate == 1)
+			wake(workers[keeper]);
+		return;
+	}
+	uint32_t cls = min(it.job->priority, static_cast<uint32_t>(NUM_CLASS - 1));
+	uint32_t node = it.job->node;
+	if (node >= num_node)
+		node = num_node;
+	waitlists[node * NUM_CLASS + cls].push_back(std::move(it));
+	++stats[cls].depth;
+	atomic_store(&ninject, ninject + 1u);
+	if (cls)
+		atomic_store(&nurgent, nurgent + 1u);
+}
+
+AsyncPool::JobPtr AsyncPool::take(uint32_t node)
+{
+	if (!ninject)
+		return JobPtr();
+	/* The highest class waiting with credits left,
+	  all credits are given again once none is left */
+	uint32_t cls = NUM_CLASS;
+	for (int pass = 0; cls == NUM_CLASS; ++pass) {
+		for (uint32_t c = NUM_CLASS; c--;) {
+			if (stats[c].depth && credits[c]) {
+				cls = c;
+				break;
+			}
+		}
+		if (cls == NUM_CLASS) {
+			GK_ASSERT(pass == 0);
+			for (uint32_t c = 0; c < NUM_CLASS; ++c)
+				credits[c] = 1u << (2 * c);
+		}
+	}
+	--credits[cls];
+
+	/* The earlier of the own node and NODE_ANY, then the earliest of other
+	  nodes if those are empty, or it is earlier and has waited the steal delay */
+	auto earlier = [](IdRing& it, IdRing* list) {
+		return !it.empty() && (!list || static_cast<int32_t>(it.front().id - list->front().id) < 0);
+	};
+	IdRing* list = nullptr;
+	if (earlier(waitlists[num_node * NUM_CLASS + cls], list))
+		list = &(waitlists[num_node * NUM_CLASS + cls]);
+	if (node < num_node && earlier(waitlists[node * NUM_CLASS + cls], list))
+		list = &(waitlists[node * NUM_CLASS + cls]);
+	IdRing* local = list;
+	int64_t now = 0;
+	for (uint32_t n = 0; n < num_node; ++n) {
+		auto& it = waitlists[n * NUM_CLASS + cls];
+		if (n == node || !earlier(it, list))
+			continue;
+		if (local && node < num_node) {
+			if (!now)
+				now = getTickCount();
+			if (now - it.front().tick < steal_ticks)
+				continue;
+		}
+		list = &it;
+	}
+	return pop(*list, 0, cls);
+}
+
+void AsyncPool::IdRing::push_back(IdJob it)
+{
+	if (num == slots.size()) {
+		std::vector<IdJob> grown(max(slots.size() * 2, size_t(16)));
+		for (size_t i = 0; i < num; ++i)
+			grown[i] = std::move((*this)[i]);
+		slots.swap(grown);
+		head = 0;
+	}
+	slots[(head + num) & (slots.size() - 1)] = std::move(it);
+	++num;
+}
+
+void AsyncPool::IdRing::pop_front()
+{
+	// Release the reference left, if not moved
+	front().job = JobPtr();
+	head = (head + 1) & (slots.size() - 1);
+	--num;
+}
+
+void AsyncPool::IdRing::erase(size_t i)
+{
+	for (; i; --i)
+		(*this)[i] = std::move((*this)[i - 1]);
+	pop_front();
+}
+
+AsyncPool::JobPtr AsyncPool::pop(IdRing& list, size_t i, uint32_t cls)
+{
+	int64_t wait = getTickCount() - list[i].tick;
+	ClassStat& stat = stats[cls];
+	--stat.depth;
+	++stat.count;
+	stat.wait += wait;
+	stat.max_wait = max(stat.max_wait, wait);
+	if (elastic_on)
+		atomic_store(&last_wait_us, static_cast<uint32_t>(min(static_cast<double>(wait) * 1e6 / getTickFrequency(), 4e9)));
+	JobPtr job = std::move(list[i].job);
+	list.erase(i);
+	atomic_store(&ninject, ninject - 1u);
+	if (nblocked)
+		space_cond.signal();
+	if (cls)
+		atomic_store(&nurgent, nurgent - 1u);
+	return job;
+}
+
+AsyncPool::JobPtr AsyncPool::takeInbox(Worker& wk, bool own)
+{
+	JobPtr job;
+	work_lock.acquire();
+	if (!wk.inbox.empty()
+		&& (own || getTickCount() - wk.inbox.front().tick >= steal_ticks)) {
+		job = std::move(wk.inbox.front().job);
+		wk.inbox.pop_front();
+		atomic_store(&(wk.ninbox), wk.ninbox - 1u);
+		atomic_store(&nprivate, nprivate - 1u);
+	}
+	work_lock.release();
+	return job;
+}
+
+AsyncPool::JobPtr AsyncPool::takeTarget(AsyncJob* target, size_t scan)
+{
+	uint32_t cls = min(target->priority, static_cast<uint32_t>(NUM_CLASS - 1));
+	for (uint32_t n = 0; n <= num_node; ++n) {
+		auto& list = waitlists[n * NUM_CLASS + cls];
+		for (size_t i = 0, end = min(list.size(), scan); i < end; ++i) {
+			if (list[i].job.get() == target)
+				return pop(list, i, cls);
+		}
+	}
+	return JobPtr();
+}
+
+AsyncPool::JobPtr AsyncPool::takeLocked(Worker& wk)
+{
+	work_lock.acquire();
+	JobPtr job = take(atomic_load(&(wk.node)));
+	work_lock.release();
+	if (job && needGrow())
+		grow();
+	return job;
+}
+
+AsyncPool::QueueStat AsyncPool::getQueueStat(uint32_t cls)
+{
+	GK_ASSERT(cls < NUM_CLASS);
+	double us = 1e6 / getTickFrequency();
+	work_lock.acquire();
+	ClassStat stat = stats[cls];
+	work_lock.release();
+	return QueueStat {stat.depth, stat.count,
+		static_cast<double>(stat.wait) * us, static_cast<double>(stat.max_wait) * us};
+}
+
+void AsyncPool::resetQueueStat()
+{
+	work_lock.acquire();
+	for (uint32_t c = 0; c < NUM_CLASS; ++c) {
+		stats[c].count = 0;
+		stats[c].wait = stats[c].max_wait = 0;
+	}
+	work_lock.release();
+}
+
+AsyncPool::JobPtr AsyncPool::find(Worker& wk)
+{
+	// Urgent jobs before the own deque, may be filled by a long loop
+	if (atomic_load(&nurgent) && !atomic_load(&(wk.stop))) {
+		if (JobPtr job = takeLocked(wk))
+			return job;
+	}
+	// Newest first, its data is likely still in cache
+	if (uintptr_t item = wk.deque.take())
+		return fromItem(item);
+	if (atomic_load(&(wk.stop)))
+		return JobPtr();
+	if (atomic_load(&(wk.ninbox))) {
+		if (JobPtr job = takeInbox(wk, true))
+			return job;
+	}
+	// Busy threads fire timers too, as none may be idle
+	if (atomic_load(&ntimer)
+		&& static_cast<int32_t>(timerClock() - atomic_load(&timer_due)) >= 0) {
+		work_lock.acquire();
+		fireTimers();
+		work_lock.release();
+	}
+	if (atomic_load(&ninject)) {
+		if (JobPtr job = takeLocked(wk))
+			return job;
+	}
+	if (JobPtr job = steal(wk))
+		return job;
+	// Jobs waiting too long for their busy threads
+	if (atomic_load(&nprivate)) {
+		uint32_t ntrd = atomic_load(&num_thread);
+		for (uint32_t i = 0; i < ntrd; ++i) {
+			if (&(workers[i]) == &wk || !atomic_load(&(workers[i].ninbox)))
+				continue;
+			if (JobPtr job = takeInbox(workers[i], false))
+				return job;
+		}
+	}
+	return JobPtr();
+}
+
+AsyncPool::JobPtr AsyncPool::steal(Worker& wk)
+{
+	/* From a random victim onwards, threads of the same node first.
+	  The deque of a stopped thread is empty or being emptied by itself */
+	uint32_t ntrd = atomic_load(&num_thread);
+	if (!ntrd)
+		return JobPtr();
+	wk.seed ^= wk.seed << 13;
+	wk.seed ^= wk.seed >> 17;
+	wk.seed ^= wk.seed << 5;
+	uint32_t node = atomic_load(&(wk.node));
+	for (int pass = node == AsyncJob::NODE_ANY; pass < 2; ++pass) {
+		for (uint32_t i = 0; i < ntrd; ++i) {
+			Worker& victim = workers[(wk.seed + i) % ntrd];
+			if (&victim == &wk || (!pass && atomic_load(&(victim.node)) != node))
+				continue;
+			if (uintptr_t item = victim.deque.steal())
+				return fromItem(item);
+		}
+	}
+	return JobPtr();
+}
+
+bool AsyncPool::idle(Worker& wk)
+{
+	work_lock.acquire();
+	if (ntimer)
+		fireTimers();
+	bool stop = atomic_load(&(wk.stop)) != 0;
+	if (!stop && !ninject && !wk.ninbox) {
+		/* Announce sleeping before looking at deques again,
+		  pairs with the fence in submit */
+		atomic_store(&nidle, nidle + 1u);
+		atomic_fence();
+		bool empty = true;
+		uint32_t ntrd = atomic_load(&num_thread);
+		for (uint32_t i = 0; empty && i < ntrd; ++i)
+			empty = workers[i].deque.empty();
+		if (empty) {
+			/* The keeper sleeps until timers are due or jobs of inboxes can be
+			  taken by others, others without timeout, until the keeper or a job wakes them */
+			int32_t ms = INT_MAX;
+			bool stealing = nprivate && steal_ticks != INT64_MAX;
+			if (keeper == UINT_MAX && (ntimer || stealing)) {
+				keeper = wk.index;
+				int64_t now = getTickCount();
+				// Rounded up, not to wake before the wheel reaches it
+				if (ntimer)
+					ms = static_cast<int32_t>(timerLeft(timer_due, now) + 1);
+				for (uint32_t i = 0; stealing && i < ntrd; ++i) {
+					if (workers[i].inbox.empty())
+						continue;
+					double left = static_cast<double>(workers[i].inbox.front().tick + steal_ticks - now);
+					ms = min(ms, static_cast<int32_t>(min(left * 1e3 / getTickFrequency() + 1, 1e9)));
+				}
+			}
+			bool top = retiring(wk);
+			if (top)
+				ms = min(ms, static_cast<int32_t>(wk.active_ms + elastic.idle_ms - timerClock()));
+			if (ms > 0) {
+				sleepers.push_back(wk.index);
+				wk.sleeping = true;
+				if (ms == INT_MAX)
+					wk.cond.wait(work_lock);
+				else
+					wk.cond.wait(work_lock, static_cast<uint32_t>(ms));
+				// Timed out, or woken spuriously
+				unsleep(wk);
+			}
+			if (keeper == wk.index)
+				keeper = UINT_MAX;
+			/* Only the highest index retires, keeping threads contiguous,
+			  not while grow starts the next one */
+			if (top && retiring(wk) && !ninject && !wk.ninbox && !growing
+				&& static_cast<int32_t>(timerClock() - wk.active_ms - elastic.idle_ms) >= 0) {
+				atomic_store(&(wk.stop), 1u);
+				atomic_store(&num_thread, num_thread - 1u);
+				stop = true;
+				// The next one to retire sleeps with timeout then
+				if (num_thread)
+					wake(workers[num_thread - 1]);
+			}
+		}
+		atomic_store(&nidle, nidle - 1u);
+	}
+	work_lock.release();
+	return !stop;
+}
+
+void AsyncPool::wakeOne()
+{
+	if (sleepers.empty())
+		return;
+	Worker& wk = workers[sleepers.back()];
+	sleepers.pop_back();
+	wk.sleeping = false;
+	wk.cond.signal();
+}
+
+void AsyncPool::wake(Worker& wk)
+{
+	if (unsleep(wk))
+		wk.cond.signal();
+}
+
+void AsyncPool::wakeAll()
+{
+	while (!sleepers.empty())
+		wakeOne();
+}
+
+bool AsyncPool::unsleep(Worker& wk)
+{
+	if (!wk.sleeping)
+		return false;
+	*std::find(sleepers.begin(), sleepers.end(), wk.index) = sleepers.back();
+	sleepers.pop_back();
+	wk.sleeping = false;
+	return true;
+}
+
+// Index of the lowest set bit of non-zero v
+static uint32_t lowBit(uint64_t v)
+{
+#if defined _MSC_VER
+	unsigned long i;
+	if (_BitScanForward(&i, static_cast<unsigned long>(v)))
+		return i;
+	_BitScanForward(&i, static_cast<unsigned long>(v >> 32));
+	return i + 32;
+#else
+	return static_cast<uint32_t>(__builtin_ctzll(v));
+#endif
+}
+
+// Index of the highest set bit of non-zero v
+static uint32_t highBit(uint32_t v)
+{
+#if defined _MSC_VER
+	unsigned long i;
+	_BitScanReverse(&i, v);
+	return i;
+#else
+	return 31u - static_cast<uint32_t>(__builtin_clz(v));
+#endif
+}
+
+uint32_t AsyncPool::timerClock() const
+{
+	double ms = static_cast<double>(getTickCount() - timer_base) * 1e3 / getTickFrequency();
+	return static_cast<uint32_t>(static_cast<uint64_t>(ms));
+}
+
+double AsyncPool::timerLeft(uint32_t due, int64_t tick) const
+{
+	double ms = static_cast<double>(tick - timer_base) * 1e3 / getTickFrequency();
+	auto clock = static_cast<uint64_t>(ms);
+	return static_cast<int32_t>(due - static_cast<uint32_t>(clock)) - (ms - static_cast<double>(clock));
+}
+
+uint64_t AsyncPool::submitAfter(std::shared_ptr<AsyncJob> job, uint32_t delay_ms)
+{
+	JobPtr ptr;
+	ptr.shared = std::move(job);
+	return addTimer(std::move(ptr), delay_ms, 0);
+}
+
+uint64_t AsyncPool::submitAfter(RefPtr<AsyncJob> job, uint32_t delay_ms)
+{
+	JobPtr ptr;
+	ptr.ref = std::move(job);
+	return addTimer(std::move(ptr), delay_ms, 0);
+}
+
+uint64_t AsyncPool::submitEvery(std::shared_ptr<AsyncJob> job, uint32_t period_ms)
+{
+	JobPtr ptr;
+	ptr.shared = std::move(job);
+	return addTimer(std::move(ptr), period_ms, period_ms);
+}
 
-AsyncJob::AsyncJob()
-	: priority(0) { }
+uint64_t AsyncPool::submitEvery(RefPtr<AsyncJob> job, uint32_t period_ms)
+{
+	JobPtr ptr;
+	ptr.ref = std::move(job);
+	return addTimer(std::move(ptr), period_ms, period_ms);
+}
 
-AsyncJob::~AsyncJob() { }
+uint64_t AsyncPool::addTimer(JobPtr job, uint32_t delay_ms, uint32_t period_ms)
+{
+	GK_ASSERT(job && delay_ms < (1u << 31) && period_ms < (1u << 31));
+	uint32_t now = timerClock();
+	work_lock.acquire();
+	uint32_t index = timer_free;
+	if (index == TIMER_NONE) {
+		index = static_cast<uint32_t>(timers.size());
+		timers.emplace_back();
+		timers[index].gen = 1;
+	} else {
+		timer_free = timers[index].next;
+	}
+	Timer& timer = timers[index];
+	timer.job = std::move(job);
+	timer.period = period_ms;
+	/* Slots up to timer_now are done,
+	  and the clock rounds down, so delays are counted from the next ms */
+	timer.due = now + delay_ms + 1;
+	if (static_cast<int32_t>(timer.due - timer_now) <= 0)
+		timer.due = timer_now + 1;
+	linkTimer(index);
+	atomic_store(&ntimer, ntimer + 1u);
+	uint32_t due = nextDue();
+	if (ntimer == 1 || static_cast<int32_t>(due - timer_due) < 0) {
+		atomic_store(&timer_due, due);
+		// The keeper sleeps longer, or one becomes the keeper
+		if (keeper != UINT_MAX)
+			wake(workers[keeper]);
+		else
+			wakeOne();
+	}
+	uint64_t id = (static_cast<uint64_t>(timer.gen) << 32) | index;
+	work_lock.release();
+	return id;
+}
 
-void AsyncJob::wait() { event.wait(0); }
+bool AsyncPool::cancel(uint64_t id)
+{
+	auto index = static_cast<uint32_t>(id);
+	bool pending = false;
+	JobPtr job;
+	work_lock.acquire();
+	if (index < timers.size() && timers[index].gen == static_cast<uint32_t>(id >> 32)
+		&& timers[index].slot != TIMER_NONE) {
+		Timer& timer = timers[index];
+		unlinkTimer(index);
+		job = std::move(timer.job);
+		++timer.gen;
+		timer.next = timer_free;
+		timer_free = index;
+		atomic_store(&ntimer, ntimer - 1u);
+		pending = true;
+	}
+	work_lock.release();
+	// Released out of the lock, its destructor may submit
+	job = JobPtr();
+	return pending;
+}
 
-AsyncPool::AsyncPool()
-	: num_thread(0), current_id(0)
+void AsyncPool::linkTimer(uint32_t index)
 {
-	for (size_t i = sizeof(workers) / sizeof(workers[0]); i--;) {
-		workers[i].index = static_cast<uint32_t>(i);
-		workers[i].stop = 0;
-		workers[i].pool = this;
-		workers[i].thread = 0;
+	Timer& timer = timers[index];
+	uint32_t level = 0, slot = timer_now & (TIMER_SLOT - 1);
+	// The highest group of bits differing from now, due ones into the current slot
+	uint32_t diff = static_cast<int32_t>(timer.due - timer_now) > 0 ? timer.due ^ timer_now : 0;
+	if (diff) {
+		level = min(highBit(diff) / TIMER_BITS, static_cast<uint32_t>(TIMER_LEVEL - 1));
+		slot = (timer.due >> (level * TIMER_BITS)) & (TIMER_SLOT - 1);
 	}
+	uint32_t head = level * TIMER_SLOT + slot;
+	timer.slot = head;
+	timer.prev = TIMER_NONE;
+	timer.next = timer_head[head];
+	if (timer.next != TIMER_NONE)
+		timers[timer.next].prev = index;
+	timer_head[head] = index;
+	timer_used[level] |= uint64_t(1) << slot;
 }
 
-AsyncPool::~AsyncPool()
+void AsyncPool::unlinkTimer(uint32_t index)
 {
-	setNumThread(0);
-	// Discard unfinished jobs
-	waitlist.clear();
+	Timer& timer = timers[index];
+	if (timer.prev != TIMER_NONE)
+		timers[timer.prev].next = timer.next;
+	else
+		timer_head[timer.slot] = timer.next;
+	if (timer.next != TIMER_NONE)
+		timers[timer.next].prev = timer.prev;
+	if (timer_head[timer.slot] == TIMER_NONE)
+		timer_used[timer.slot / TIMER_SLOT] &= ~(uint64_t(1) << (timer.slot % TIMER_SLOT));
+	timer.slot = TIMER_NONE;
 }
 
-void AsyncPool::setNumThread(uint32_t n)
+uint32_t AsyncPool::nextDue() const
 {
-	n = min(n, static_cast<uint32_t>(MAX_THREAD));
-	pool_lock.acquire();
-	if (n < num_thread) {
-		work_lock.acquire();
-		for (uint32_t i = n; i < num_thread; ++i)
-			workers[i].stop = 1;
-		work_lock.release();
-		work_cond.broadcast();
-		for (uint32_t i = n; i < num_thread; ++i) {
-#if defined _WIN32
-			WaitForSingleObject(reinterpret_cast<HANDLE>(workers[i].thread), INFINITE);
-#elif defined __linux__
-			pthread_join(workers[i].thread, NULL);
-#endif
-			workers[i].thread = INT_MAX;
-		}
+	// The next used slot of the lowest level in use
+	for (uint32_t level = 0; level < TIMER_LEVEL; ++level) {
+		uint64_t used = timer_used[level];
+		if (!used)
+			continue;
+		uint32_t shift = level * TIMER_BITS;
+		uint32_t cur = (timer_now >> shift) & (TIMER_SLOT - 1);
+		uint64_t after = cur + 1 < TIMER_SLOT ? used & (~uint64_t(0) << (cur + 1)) : 0;
+		uint32_t ahead = after ? lowBit(after) - cur : lowBit(used) + TIMER_SLOT - cur;
+		return ((timer_now >> shift) + ahead) << shift;
 	}
-	if (n > num_thread) {
-		for (uint32_t i = num_thread; i < n; ++i) {
-			workers[i].stop = 0;
-#if defined _WIN32
-			workers[i].thread = _beginthreadex(
-				NULL, 0, trdRoutine, workers + i, 0, &(workers[i].win32_id));
-			if (workers[i].thread == 0
-				|| workers[i].thread == static_cast<uintptr_t>(-1)) {
-				DWORD err = GetLastError();
-				GK_LOG_ERROR("worker %d can not create thread, "
-										 "handle = %llx, err = %u, errno %s\n",
-					i, workers[i].thread, static_cast<unsigned>(err), strerror(errno));
+	return timer_now + (1u << 30);
+}
+
+void AsyncPool::fireTimers()
+{
+	uint32_t now = timerClock();
+	uint32_t fired = ninject;
+	while (static_cast<int32_t>(now - timer_now) > 0) {
+		// Skip to the next slot of the lowest level in use, at most now
+		uint32_t level = 0;
+		while (level < TIMER_LEVEL && !timer_used[level])
+			++level;
+		uint32_t next = now;
+		if (level < TIMER_LEVEL) {
+			uint32_t step = 1u << (level * TIMER_BITS);
+			next = (timer_now | (step - 1)) + 1;
+			if (static_cast<int32_t>(next - now) > 0)
+				next = now;
+		}
+		timer_now = next;
+		// Higher levels cascade down at their boundaries, then level 0 fires
+		for (uint32_t l = TIMER_LEVEL; --l > 0;) {
+			uint32_t shift = l * TIMER_BITS;
+			if (timer_now & ((1u << shift) - 1))
+				continue;
+			uint32_t head = l * TIMER_SLOT + ((timer_now >> shift) & (TIMER_SLOT - 1));
+			uint32_t index = timer_head[head];
+			timer_head[head] = TIMER_NONE;
+			timer_used[l] &= ~(uint64_t(1) << (head % TIMER_SLOT));
+			while (index != TIMER_NONE) {
+				uint32_t next_index = timers[index].next;
+				linkTimer(index);
+				index = next_index;
 			}
-#elif defined __linux__
-			char info[16];
-			pthread_create(&(workers[i].thread), NULL, trdRoutine, workers + i);
-			snprintf(info, sizeof(info), "ATrd%u", i);
-			pthread_setname_np(workers[i].thread, info);
-#endif
 		}
+		fireSlot(timer_now & (TIMER_SLOT - 1));
 	}
-	num_thread = n;
-	pool_lock.release();
+	atomic_store(&timer_due, nextDue());
+	fired = ninject - fired;
+	for (uint32_t n = fired; n-- && !sleepers.empty();)
+		wakeOne();
 }
 
-void AsyncPool::submit(std::shared_ptr<AsyncJob> job)
+void AsyncPool::fireSlot(uint32_t slot)
 {
-	uint32_t ntrd = 0;
-	pool_lock.acquire();
-	ntrd = num_thread;
-	pool_lock.release();
-	if (ntrd < 1) {
-		job->call();
-		return;
+	uint32_t index = timer_head[slot];
+	timer_head[slot] = TIMER_NONE;
+	timer_used[0] &= ~(uint64_t(1) << slot);
+	int64_t tick = getTickCount();
+	while (index != TIMER_NONE) {
+		Timer& timer = timers[index];
+		uint32_t next_index = timer.next;
+		timer.slot = TIMER_NONE;
+		event.enter();
+		timer.job->event.enter();
+		if (timer.period) {
+			put(IdJob {current_id++, tick, timer.job});
+			// Without drift, but not catching up missed periods
+			timer.due += timer.period;
+			if (static_cast<int32_t>(timer.due - timer_now) <= 0)
+				timer.due = timer_now + timer.period;
+			linkTimer(index);
+		} else {
+			put(IdJob {current_id++, tick, std::move(timer.job)});
+			++timer.gen;
+			timer.next = timer_free;
+			timer_free = index;
+			atomic_store(&ntimer, ntimer - 1u);
+		}
+		index = next_index;
 	}
+}
 
-	event.enter();
-	job->event.enter();
-	work_lock.acquire();
-	uint32_t id = current_id++;
-	if (job->priority) {
-		// Cutting in queue by up to randomly 8 to 15
-		uint32_t jump = static_cast<uint32_t>(rand() & 7) + 8;
-		id -= min(min(job->priority, jump), id);
-	}
-	waitlist.push_back(IdJob {id, job});
-	push_heap(waitlist.begin(), waitlist.end());
-	work_lock.release();
-	work_cond.signal();
+void AsyncPool::run(JobPtr const& job, uint32_t index)
+{
+	void* slot = sSlotPool;
+	if (index == max_thread)
+		sSlotPool = this;
+	job->call(index);
+	sSlotPool = slot;
+	// Job has been completed, notify sleeping threads and coroutines
+	job->leave();
+	// All jobs in queue are completed, notify the main thread
+	if (event.leave() == 1)
+		event.wake();
+}
+
+void AsyncPool::help(JobEvent& ev, AsyncJob* target, Worker* wk)
+{
+	// Deep, take only jobs this thread queued, the awaited one among them
+	bool capped = sHelpDepth >= MAX_HELP_DEPTH;
+	++sHelpDepth;
+	while (ev.load()) {
+		JobPtr job;
+		// Out of the pool, jobs are done only with the slot held
+		uint32_t index = wk ? wk->index : enterSlot();
+		// Shards just submitted by this thread are the newest of its deque
+		if (wk) {
+			if (uintptr_t item = wk->deque.take())
+				job = fromItem(item);
+		}
+		if (!job && index != UINT_MAX && target && atomic_load(&ninject)) {
+			work_lock.acquire();
+			// Only near the front, not to scan long queues on every job,
+			// but all of them when nothing else may be done
+			job = takeTarget(target, capped ? SIZE_MAX : 64);
+			work_lock.release();
+		}
+		if (!job && wk && !capped)
+			job = find(*wk);
+		if (!job && !wk && !capped && index != UINT_MAX && atomic_load(&ninject)) {
+			work_lock.acquire();
+			job = take(AsyncJob::NODE_ANY);
+			work_lock.release();
+		}
+		if (job)
+			run(job, index);
+		leaveSlot(index);
+		if (!job) {
+			WaitStat& ws = wk ? wk->stat : wait_stat;
+			bool slept = ev.wait(0, atomic_load(&spin_count));
+			atomic_fetch_add(slept ? &(ws.sleep) : &(ws.spin), 1u);
+		}
+	}
+	--sHelpDepth;
+}
+
+void AsyncPool::wait()
+{
+	auto wk = static_cast<Worker*>(sAsyncWorker);
+	help(event, nullptr, wk && wk->pool == this ? wk : nullptr);
 }
 
-void AsyncPool::wait() { event.wait(0); }
+void AsyncPool::wait(AsyncJob& job)
+{
+	auto wk = static_cast<Worker*>(sAsyncWorker);
+	help(job.event, &job, wk && wk->pool == this ? wk : nullptr);
+}
 
 #if defined _WIN32
 unsigned AsyncPool::trdRoutine(void* void_args)
@@ -145,27 +1481,25 @@ void* AsyncPool::trdRoutine(void* void_args)
 {
 	auto wk = reinterpret_cast<Worker*>(void_args);
 	auto pool = wk->pool;
+	sAsyncWorker = wk;
 	while (true) {
-		std::shared_ptr<AsyncJob> job;
-		pool->work_lock.acquire();
-		while (!(wk->stop) && pool->waitlist.empty())
-			pool->work_cond.wait(pool->work_lock);
-		if (!(wk->stop)) {
-			std::pop_heap(pool->waitlist.begin(), pool->waitlist.end());
-			job = pool->waitlist.back().job;
-			pool->waitlist.pop_back();
-		}
-		pool->work_lock.release();
-		if (!job)
+		JobPtr job = pool->find(*wk);
+		if (!job) {
+			// Spin before sleeping, looking for jobs again
+			for (uint32_t n = atomic_load(&(pool->spin_count)); !job && n; --n) {
+				yield(1);
+				job = pool->find(*wk);
+			}
+			atomic_fetch_add(job ? &(wk->stat.spin) : &(wk->stat.sleep), 1u);
+		}
+		if (job) {
+			pool->run(job, wk->index);
+			if (atomic_load(&(pool->elastic_on)))
+				wk->active_ms = pool->timerClock();
+		} else if (!pool->idle(*wk))
 			break;
-		job->call();
-		// Job has been completed, notify sleeping threads
-		if (job->event.leave() == 1)
-			job->event.wake();
-		// All jobs in queue are completed, notify the main thread
-		if (pool->event.leave() == 1)
-			pool->event.wake();
 	}
+	sAsyncWorker = nullptr;
 #if defined _WIN32
 	return wk->index;
 #elif defined __linux__
@@ -173,48 +1507,483 @@ void* AsyncPool::trdRoutine(void* void_args)
 #endif
 }
 
+void FutureBase::init(AsyncPool* pl)
+{
+	pool = pl;
+	priority = 0;
+	node = NODE_ANY;
+	worker = WORKER_ANY;
+	conts = 0;
+	next_cont = nullptr;
+	abandoned = false;
+	done.enter();
+}
+
+void FutureBase::complete()
+{
+	if (done.leave() == 1)
+		done.wake();
+	uintptr_t head = atomic_exchange(&conts, static_cast<uintptr_t>(DONE));
+	while (head) {
+		auto cont = reinterpret_cast<FutureBase*>(head);
+		head = reinterpret_cast<uintptr_t>(cont->next_cont);
+		pool->submit(RefPtr<AsyncJob>::adopt(cont));
+	}
+}
+
+void FutureBase::attach(RefPtr<FutureBase> cont)
+{
+	FutureBase* ptr = cont.get();
+	uintptr_t head = atomic_load(&conts);
+	do {
+		if (head == DONE) {
+			if (abandoned)
+				cont->abandon();
+			else
+				pool->submit(RefPtr<AsyncJob>(std::move(cont)));
+			return;
+		}
+		ptr->next_cont = reinterpret_cast<FutureBase*>(head);
+	} while (!atomic_compare_exchange(&conts, &head, reinterpret_cast<uintptr_t>(ptr)));
+	cont.release();
+}
+
+void FutureBase::discard()
+{
+	abandon();
+	AsyncJob::discard();
+}
+
+void FutureBase::abandon()
+{
+	abandoned = true;
+	if (done.leave() == 1)
+		done.wake();
+	uintptr_t head = atomic_exchange(&conts, static_cast<uintptr_t>(DONE));
+	while (head) {
+		auto cont = reinterpret_cast<FutureBase*>(head);
+		head = reinterpret_cast<uintptr_t>(cont->next_cont);
+		// Before its reference is released, may be the last one
+		cont->abandon();
+		RefPtr<AsyncJob>::adopt(cont);
+	}
+}
+
+void AsyncPool::wait(JobEvent& ev)
+{
+	auto wk = static_cast<Worker*>(sAsyncWorker);
+	help(ev, nullptr, wk && wk->pool == this ? wk : nullptr);
+}
+
+namespace {
+
+// A freed frame
+struct Frame {
+	Frame* next;
+};
+
+struct FrameList {
+	Frame* head;
+	uint32_t count;
+};
+
+enum : uint32_t {
+	FRAME_STEP = 64,
+	FRAME_CLASS = FramePool::MAX_SIZE / FRAME_STEP,
+	FRAME_BATCH = 32
+};
+
+struct FrameShared {
+	JobLock lock;
+	std::vector<FrameList> batches[FRAME_CLASS];
+
+	~FrameShared()
+	{
+		for (auto& lists : batches) {
+			for (FrameList& list : lists) {
+				while (Frame* frame = list.head) {
+					list.head = frame->next;
+					::operator delete(frame);
+				}
+			}
+		}
+	}
+};
+
+FrameShared& frameShared()
+{
+	static FrameShared shared;
+	return shared;
+}
+
+// Of the thread, given to the shared lists when the thread exits
+struct FrameLocal {
+	FrameList lists[FRAME_CLASS];
+
+	FrameLocal()
+	{
+		frameShared();
+		for (FrameList& list : lists)
+			list = FrameList {nullptr, 0};
+	}
+	~FrameLocal()
+	{
+		FrameShared& shared = frameShared();
+		shared.lock.acquire();
+		for (uint32_t c = 0; c < FRAME_CLASS; ++c) {
+			if (lists[c].head)
+				shared.batches[c].push_back(lists[c]);
+		}
+		shared.lock.release();
+	}
+};
+
+FrameLocal& frameLocal()
+{
+	static thread_local FrameLocal local;
+	return local;
+}
+
+}
+
+void* FramePool::alloc(size_t size)
+{
+	if (!size || size > MAX_SIZE)
+		return ::operator new(size);
+	size_t c = (size - 1) / FRAME_STEP;
+	FrameList& list = frameLocal().lists[c];
+	if (!list.head) {
+		FrameShared& shared = frameShared();
+		shared.lock.acquire();
+		if (!shared.batches[c].empty()) {
+			list = shared.batches[c].back();
+			shared.batches[c].pop_back();
+		}
+		shared.lock.release();
+	}
+	if (Frame* frame = list.head) {
+		list.head = frame->next;
+		--list.count;
+		return frame;
+	}
+	return ::operator new((c + 1) * FRAME_STEP);
+}
+
+void FramePool::free(void* ptr, size_t size)
+{
+	if (!size || size > MAX_SIZE) {
+		::operator delete(ptr);
+		return;
+	}
+	size_t c = (size - 1) / FRAME_STEP;
+	FrameList& list = frameLocal().lists[c];
+	auto frame = static_cast<Frame*>(ptr);
+	frame->next = list.head;
+	list.head = frame;
+	if (++list.count < 2 * FRAME_BATCH)
+		return;
+	FrameList batch {nullptr, 0};
+	for (; batch.count < FRAME_BATCH; ++batch.count) {
+		Frame* it = list.head;
+		list.head = it->next;
+		it->next = batch.head;
+		batch.head = it;
+	}
+	list.count -= FRAME_BATCH;
+	FrameShared& shared = frameShared();
+	shared.lock.acquire();
+	shared.batches[c].push_back(batch);
+	shared.lock.release();
+}
+
 ////////////////////////////////////////////////////////////
 
-SyncPool::JobRef::JobRef(SyncJob& sjob, uint32_t ntrd)
+JobGraph::JobGraph()
+	: dirty(false), pool(nullptr) { }
+
+JobGraph::~JobGraph() { wait(); }
+
+uint32_t JobGraph::add(std::shared_ptr<AsyncJob> job)
 {
-	job = &sjob;
-	nstripe = ntrd;
-	maxcall = min(job->maxcall, sjob.allend - sjob.allstart);
-	allstart = index = sjob.allstart;
-	allend = sjob.allend;
+	GK_ASSERT(!event.load());
+	RefPtr<Task> task(new Task());
+	task->graph = this;
+	task->job = std::move(job);
+	task->ndep = task->pending = 0;
+	tasks.push_back(std::move(task));
+	dirty = true;
+	return static_cast<uint32_t>(tasks.size() - 1);
 }
 
-SyncPool::JobRef::~JobRef()
+void JobGraph::precede(uint32_t from, uint32_t to)
 {
-	GK_ASSERT(!job || index >= allend);
+	GK_ASSERT(from < tasks.size() && to < tasks.size() && from != to);
+	GK_ASSERT(!event.load());
+	tasks[from]->succs.push_back(to);
+	++tasks[to]->ndep;
+	dirty = true;
 }
 
-void SyncPool::JobRef::execute(uint32_t tid)
+void JobGraph::run(AsyncPool& pl)
 {
-	while (true) {
-		uint32_t start = atomic_load(&index);
-		if (start >= allend)
-			break;
-		uint32_t stripe = (allend - start) / nstripe / 4u;
+	GK_ASSERT(!event.load());
+	if (dirty) {
+		// Kahn's algorithm, every task is reached unless there is a cycle
+		std::vector<uint32_t> order;
+		for (uint32_t i = 0; i < tasks.size(); ++i) {
+			tasks[i]->pending = tasks[i]->ndep;
+			if (!tasks[i]->ndep)
+				order.push_back(i);
+		}
+		roots = order;
+		for (size_t i = 0; i < order.size(); ++i) {
+			for (uint32_t s : tasks[order[i]]->succs) {
+				if (!--tasks[s]->pending)
+					order.push_back(s);
+			}
+		}
+		if (order.size() != tasks.size())
+			GK_LOG_ERROR("graph has a cycle\n");
+		dirty = false;
+	}
+	if (tasks.empty())
+		return;
+	pool = &pl;
+	for (RefPtr<Task>& task : tasks) {
+		task->pending = task->ndep;
+		task->priority = task->job->priority;
+		task->node = task->job->node;
+		task->worker = task->job->worker;
+	}
+	event.enter(static_cast<uint32_t>(tasks.size()));
+	for (uint32_t i : roots)
+		pool->submit(RefPtr<AsyncJob>(tasks[i]));
+}
+
+void JobGraph::wait()
+{
+	if (!pool)
+		return;
+	auto wk = static_cast<AsyncPool::Worker*>(sAsyncWorker);
+	pool->help(event, nullptr, wk && wk->pool == pool ? wk : nullptr);
+}
+
+void JobGraph::Task::call(uint32_t trd)
+{
+	job->call(trd);
+	for (uint32_t s : succs) {
+		Task* succ = graph->tasks[s].get();
+		if (atomic_fetch_add(&(succ->pending), -1) == 1)
+			graph->pool->submit(RefPtr<AsyncJob>(succ));
+	}
+	// After successors are counted in, so the run is not seen completed early
+	if (graph->event.leave() == 1)
+		graph->event.wake();
+}
+
+////////////////////////////////////////////////////////////
+
+SyncPool::JobRef::JobRef(
+	SyncJob::Schedule sched, uint32_t ncall, uint32_t start, uint32_t end)
+{
+	run = nullptr;
+	job = nullptr;
+	schedule = sched;
+	nstripe = 1;
+	maxcall = min(ncall, end - start);
+	allstart = index = start;
+	allend = end;
+	stripe = end - start;
+	grain = 0;
+	target = 0;
+	type = nullptr;
+	shares = &own;
+}
+
+void SyncPool::JobRef::check() const
+{
+	GK_ASSERT(index >= allend);
+	if (schedule != SyncJob::sched_dynamic && schedule != SyncJob::sched_auto) {
+		for (uint32_t t = 0; t < nstripe; ++t) {
+			uint64_t range = shares[t].range;
+			GK_ASSERT(static_cast<uint32_t>(range) >= static_cast<uint32_t>(range >> 32));
+		}
+	}
+}
+
+void SyncPool::JobRef::partition(uint32_t ntrd)
+{
+	nstripe = ntrd;
+	if (ntrd < 2) {
+		// A one-share steal, the only thread takes all in one slice
+		schedule = SyncJob::sched_steal;
+		stripe = allend - allstart;
+		shares[0].node = 0;
+	} else if (schedule == SyncJob::sched_static) {
+		// As OpenMP schedule(static), one slice per thread by default
+		stripe = (allend - allstart - 1) / nstripe + 1u;
+		if (maxcall)
+			stripe = (allend - allstart + maxcall - 1) / maxcall;
+	} else if (schedule == SyncJob::sched_auto) {
+		// Start from the tuned one, or small to measure soon
+		if (!grain)
+			grain = max((allend - allstart) / nstripe / 64u, 1u);
+		target = static_cast<int64_t>(getTickFrequency() * static_cast<double>(SyncJob::AUTO_SLICE_US) * 1e-6);
+		for (uint32_t t = 0; t < ntrd; ++t)
+			shares[t].slice = 0;
+	} else if (schedule != SyncJob::sched_dynamic) {
+		// Small slices from the own share, so that others have something to steal
+		stripe = (allend - allstart) / nstripe / 8u;
 		if (maxcall)
 			stripe = (allend - allstart + maxcall - 1) / maxcall;
 		stripe = max(stripe, 1u);
-		start = atomic_fetch_add(&index, stripe);
-		if (start >= allend)
-			break;
-		job->call(tid, start, min(start + stripe, allend));
+	}
+	if (schedule != SyncJob::sched_dynamic && schedule != SyncJob::sched_auto) {
+		/* Contiguous shares, numbered by (node, tid) of threads,
+		  thread tid takes the tid-th one if all on one node */
+		uint64_t range = allend - allstart;
+		for (uint32_t node = 0, k = 0; k < ntrd; ++node) {
+			for (uint32_t t = 0; t < ntrd; ++t) {
+				if (shares[t].node != node)
+					continue;
+				uint64_t start = allstart + range * k / ntrd;
+				uint64_t end = allstart + range * (k + 1) / ntrd;
+				shares[t].range = (end << 32) | start;
+				++k;
+			}
+		}
+		index = allend;
+	}
+}
+
+bool SyncPool::JobRef::next(uint32_t tid, uint32_t& start, uint32_t& end)
+{
+	if (schedule == SyncJob::sched_auto)
+		return nextAuto(tid, start, end);
+	if (schedule != SyncJob::sched_dynamic)
+		return nextShare(tid, start, end);
+	start = atomic_load(&index);
+	if (start >= allend)
+		return false;
+	uint32_t slice = (allend - start) / nstripe / 4u;
+	if (maxcall)
+		slice = (allend - allstart + maxcall - 1) / maxcall;
+	slice = max(slice, 1u);
+	start = atomic_fetch_add(&index, slice);
+	if (start >= allend)
+		return false;
+	end = min(start + slice, allend);
+	return true;
+}
+
+bool SyncPool::JobRef::nextAuto(uint32_t tid, uint32_t& start, uint32_t& end)
+{
+	Share& share = shares[tid];
+	int64_t now = getTickCount();
+	uint32_t slice = atomic_load(&grain);
+	if (share.slice) {
+		// Scale the last slice to take target ticks, by at most 2x each time
+		double elapse = static_cast<double>(max(now - share.tick, static_cast<int64_t>(1)));
+		double want = share.slice * static_cast<double>(target) / elapse;
+		want = clamp(want, share.slice * 0.5, share.slice * 2.0);
+		slice = max(static_cast<uint32_t>(min(want, static_cast<double>(UINT_MAX / 2))), 1u);
+		atomic_store(&grain, slice);
+	}
+	start = atomic_load(&index);
+	if (start >= allend)
+		return false;
+	slice = min(slice, max((allend - start) / nstripe / 2u, 1u));
+	start = atomic_fetch_add(&index, slice);
+	if (start >= allend)
+		return false;
+	end = min(start + slice, allend);
+	share.tick = now;
+	share.slice = end - start;
+	return true;
+}
+
+bool SyncPool::JobRef::nextShare(uint32_t tid, uint32_t& start, uint32_t& end)
+{
+	uint64_t* address = &(shares[tid].range);
+	do {
+		uint64_t val, old = atomic_load(address);
+		while (true) {
+			start = static_cast<uint32_t>(old);
+			end = static_cast<uint32_t>(old >> 32);
+			if (start >= end)
+				break;
+			end = start + min(stripe, end - start);
+			val = (old & ~static_cast<uint64_t>(UINT_MAX)) | end;
+			if (atomic_compare_exchange(address, &old, val))
+				return true;
+		}
+	} while (steal(tid));
+	return false;
+}
+
+bool SyncPool::JobRef::steal(uint32_t tid)
+{
+	/* Choose the victim with the most remaining, on the same node if any.
+	  The stolen range is invisible to others until it is stored in our share,
+	  others may quit a little early, but every index is still done once */
+	if (schedule == SyncJob::sched_static)
+		return false;
+	uint32_t node = shares[tid].node;
+	while (true) {
+		uint32_t victim = tid, most = 0, near = tid, most_near = 0;
+		for (uint32_t i = 1; i < nstripe; ++i) {
+			uint32_t t = (tid + i) % nstripe;
+			uint64_t range = atomic_load(&(shares[t].range));
+			uint32_t start = static_cast<uint32_t>(range);
+			uint32_t end = static_cast<uint32_t>(range >> 32);
+			if (start >= end)
+				continue;
+			if (end - start > most) {
+				victim = t;
+				most = end - start;
+			}
+			if (shares[t].node == node && end - start > most_near) {
+				near = t;
+				most_near = end - start;
+			}
+		}
+		if (near != tid)
+			victim = near;
+		if (victim == tid)
+			return false;
+		uint64_t* address = &(shares[victim].range);
+		uint64_t old = atomic_load(address);
+		uint32_t start = static_cast<uint32_t>(old);
+		uint32_t end = static_cast<uint32_t>(old >> 32);
+		if (start >= end)
+			continue;
+		/* Take the upper half, the owner keeps going forward from start.
+		  For affinity, only one slice from the tail */
+		uint32_t mid = start + (end - start) / 2u;
+		if (schedule == SyncJob::sched_affinity)
+			mid = end - min(stripe, end - start);
+		uint64_t val = (static_cast<uint64_t>(mid) << 32) | start;
+		if (atomic_compare_exchange(address, &old, val)) {
+			atomic_store(&(shares[tid].range), (static_cast<uint64_t>(end) << 32) | mid);
+			return true;
+		}
 	}
 }
 
-SyncPool::SyncPool()
-	: num_worker(0)
+SyncPool::SyncPool(uint32_t max_thread)
+	: num_worker(0), max_worker(maxThread(max_thread) - 1), spin_count(0), busy(0),
+		workers(max_worker), shares(max_worker + 1),
+		all(UINT_MAX), current(nullptr), topo(CpuTopology::system())
 {
-	for (size_t i = sizeof(workers) / sizeof(workers[0]); i--;) {
-		workers[i].index = static_cast<uint32_t>(i);
+	for (uint32_t i = max_worker; i--;) {
+		workers[i].index = i;
 		workers[i].stop = 0;
+		workers[i].seen = 0;
+		workers[i].ticket = UINT_MAX;
 		workers[i].pool = this;
 		workers[i].thread = 0;
 	}
+	resetWaitStat();
 }
 
 SyncPool::~SyncPool()
@@ -222,20 +1991,29 @@ SyncPool::~SyncPool()
 	// We will wait until all sub-threads stop
 	// So no JobRef object is active
 	setNumThread(0);
+	// Not left pinned to one CPU without the pool
+	if (!places.empty() && !topo.fake)
+		pinThread(currentThread(), UINT_MAX);
 }
 
 void SyncPool::setNumThread(uint32_t n)
 {
 	// if n == 1 or 0, only the main thread do jobs
-	n = min(n, static_cast<uint32_t>(MAX_THREAD));
+	n = min(n, max_worker + 1);
 	n = max(n, 1u) - 1u;
+	// After the running job, others are done by their threads alone meanwhile
+	atomic_fetch_add(&busy, 2u);
+	while (atomic_load(&busy) & 1u)
+		yield(1);
 	pool_lock.acquire();
+	if (n < num_worker) {
+		for (uint32_t i = n; i < num_worker; ++i)
+			workers[i].stop = 1;
+		// An epoch without job, stopped workers quit after checking in
+		dispatch(nullptr, n, num_worker);
+		join();
+	}
 	for (uint32_t i = n; i < num_worker; ++i) {
-		workers[i].lock.acquire();
-		workers[i].stop = 1;
-		workers[i].ref = nullptr;
-		workers[i].lock.release();
-		workers[i].cond.signal();
 #if defined _WIN32
 		WaitForSingleObject(reinterpret_cast<HANDLE>(workers[i].thread), INFINITE);
 #elif defined __linux__
@@ -245,9 +2023,11 @@ void SyncPool::setNumThread(uint32_t n)
 	}
 	for (uint32_t i = num_worker; i < n; ++i) {
 		workers[i].stop = 0;
+		// No epoch can be started before we release busy
+		workers[i].seen = epoch.load();
 #if defined _WIN32
 		workers[i].thread = _beginthreadex(
-			NULL, 0, trdRoutine, workers + i, 0, &(workers[i].win32_id));
+			NULL, 0, trdRoutine, &(workers[i]), 0, &(workers[i].win32_id));
 		if (workers[i].thread == 0
 			|| workers[i].thread == static_cast<uintptr_t>(-1)) {
 			DWORD err = GetLastError();
@@ -257,44 +2037,253 @@ void SyncPool::setNumThread(uint32_t n)
 		}
 #elif defined __linux__
 		char info[16];
-		pthread_create(&(workers[i].thread), NULL, trdRoutine, workers + i);
+		pthread_create(&(workers[i].thread), NULL, trdRoutine, &(workers[i]));
 		snprintf(info, sizeof(info), "ATrd%u", i);
 		pthread_setname_np(workers[i].thread, info);
 #endif
+		if (!places.empty() && !topo.fake)
+			pinThread(workers[i].thread, placeOf(places, i));
 	}
 	num_worker = n;
 	pool_lock.release();
+	atomic_fetch_add(&busy, UINT_MAX - 1u);
 }
 
-void SyncPool::submit(SyncJob& job)
+void SyncPool::applyAffinity()
 {
-	if (job.allstart >= job.allend)
+	bool pinned = !places.empty();
+	places = affinity.place(topo);
+	nodes.clear();
+	for (uint32_t cpu : places)
+		nodes.push_back(topo.nodeOf(cpu));
+	if (topo.fake || (!pinned && places.empty()))
+		return;
+	for (uint32_t i = 0; i < num_worker; ++i)
+		pinThread(workers[i].thread, placeOf(places, i));
+	pinThread(currentThread(), placeOf(places, num_worker));
+}
+
+void SyncPool::setAffinity(CpuAffinity const& aff)
+{
+	pool_lock.acquire();
+	affinity = aff;
+	applyAffinity();
+	pool_lock.release();
+}
+
+void SyncPool::setTopology(CpuTopology const& topology)
+{
+	pool_lock.acquire();
+	topo = topology;
+	applyAffinity();
+	pool_lock.release();
+}
+
+SyncPool::WaitStat SyncPool::getWaitStat() const
+{
+	WaitStat sum = stat;
+	for (uint32_t i = max_worker; i--;) {
+		sum.spin += workers[i].stat.spin;
+		sum.sleep += workers[i].stat.sleep;
+	}
+	return sum;
+}
+
+void SyncPool::resetWaitStat()
+{
+	stat.spin = stat.sleep = 0;
+	for (uint32_t i = max_worker; i--;)
+		workers[i].stat.spin = workers[i].stat.sleep = 0;
+}
+
+void SyncPool::dispatch(JobRef* ref, uint32_t begin, uint32_t end)
+{
+	event.enter(end - begin);
+	current = ref;
+	uint32_t next = epoch.next();
+	if (!begin && end == num_worker) {
+		atomic_store(&all, next);
+		epoch.bump();
 		return;
+	}
+	atomic_store(&all, UINT_MAX);
+	uint32_t bits = 0;
+	for (uint32_t i = begin; i < end; ++i) {
+		atomic_store(&(workers[i].ticket), next);
+		bits |= 1u << (i % 32);
+	}
+	epoch.bump(bits);
+}
+
+void SyncPool::join()
+{
+	bool slept = event.wait(0, atomic_load(&spin_count));
+	atomic_fetch_add(slept ? &(stat.sleep) : &(stat.spin), 1u);
+	current = nullptr;
+}
 
-	uint32_t ntrd = job.allend - job.allstart;
-	if (job.maxcall)
-		ntrd = min(ntrd, job.maxcall);
+void SyncPool::launch(JobRef& ref)
+{
+	uint32_t ntrd = ref.allend - ref.allstart;
+	if (ref.maxcall)
+		ntrd = min(ntrd, ref.maxcall);
+	uint32_t idle = 0;
+	if (!atomic_compare_exchange(&busy, &idle, 1u)) {
+		ref.partition(1);
+		ref.run(ref, 0);
+		ref.check();
+		return;
+	}
 	pool_lock.acquire();
 	ntrd = min(ntrd, num_worker + 1);
 	if (ntrd < 2) {
 		pool_lock.release();
-		job.call(0, job.allstart, job.allend);
+		atomic_fetch_add(&busy, UINT_MAX);
+		ref.partition(1);
+		ref.run(ref, 0);
+		ref.check();
 		return;
 	}
 
 	// The main thread also needs to work
 	uint32_t subtrd = ntrd - 1;
-	auto ref = std::make_shared<JobRef>(job, ntrd);
-	for (uint32_t i = 0; i < subtrd; ++i) {
-		workers[i].lock.acquire();
-		workers[i].ref = ref;
-		workers[i].lock.release();
-		workers[i].cond.signal();
+	bool tune = ref.schedule == SyncJob::sched_auto && ref.type;
+	if (tune) {
+		auto it = grains.find(*(ref.type));
+		if (it != grains.end())
+			ref.grain = it->second;
+	}
+	ref.shares = shares.data();
+	if (ref.schedule != SyncJob::sched_dynamic && ref.schedule != SyncJob::sched_auto) {
+		// The main thread sits on the place after workers
+		for (uint32_t t = 0; t < ntrd; ++t) {
+			uint32_t place = t == subtrd ? num_worker : t;
+			ref.shares[t].node = nodes.empty() ? 0 : nodes[place % nodes.size()];
+		}
 	}
+	// Workers are not changed while busy is set
 	pool_lock.release();
-	ref->execute(subtrd);
+	ref.partition(ntrd);
+	dispatch(&ref, 0, subtrd);
+	ref.run(ref, subtrd);
 	// Waiting for job completed
-	ref->event.wait(0);
+	join();
+	ref.check();
+	if (tune) {
+		pool_lock.acquire();
+		grains[*(ref.type)] = ref.grain;
+		pool_lock.release();
+	}
+	atomic_fetch_add(&busy, UINT_MAX);
+}
+
+void SyncPool::JobRef::call(JobRef& ref, uint32_t tid)
+{
+	SyncJob* job = static_cast<SyncJob*>(ref.job);
+	for (uint32_t start, end; ref.next(tid, start, end);)
+		job->call(tid, start, end);
+}
+
+void SyncPool::submit(SyncJob& job)
+{
+	if (job.allstart >= job.allend)
+		return;
+	JobRef ref(job.schedule, job.maxcall, job.allstart, job.allend);
+	ref.run = &JobRef::call;
+	ref.job = &job;
+	ref.type = &typeid(job);
+	launch(ref);
+}
+
+void SyncPool::submit(SyncJob64& job)
+{
+	auto slices = [&job](uint32_t tid, uint64_t start, uint64_t end) {
+		job.call(tid, start, end);
+	};
+	launchFor64(job.allstart, job.allend, slices, job.schedule, typeid(job), job.maxcall);
+}
+
+// Even bits of x, i.e. one coordinate of Morton code
+static uint32_t compactBits(uint32_t x)
+{
+	x &= 0x55555555u;
+	x = (x ^ (x >> 1)) & 0x33333333u;
+	x = (x ^ (x >> 2)) & 0x0f0f0f0fu;
+	x = (x ^ (x >> 4)) & 0x00ff00ffu;
+	x = (x ^ (x >> 8)) & 0x0000ffffu;
+	return x;
+}
+
+// d-th cell on Hilbert curve of n x n (n is power of 2)
+static void hilbertCell(uint32_t n, uint32_t d, uint32_t& y, uint32_t& x)
+{
+	y = x = 0;
+	for (uint32_t s = 1; s < n; s *= 2u, d /= 4u) {
+		uint32_t rx = 1u & (d / 2u);
+		uint32_t ry = 1u & (d ^ rx);
+		if (!ry) {
+			if (rx) {
+				x = s - 1u - x;
+				y = s - 1u - y;
+			}
+			uint32_t t = x;
+			x = y;
+			y = t;
+		}
+		x += s * rx;
+		y += s * ry;
+	}
+}
+
+void SyncPool::submit(SyncJob2D& job)
+{
+	if (!job.rows || !job.cols)
+		return;
+	uint32_t th = max(job.tile_rows, 1u), tw = max(job.tile_cols, 1u);
+	uint32_t ty = (job.rows - 1u) / th + 1u;
+	uint32_t tx = (job.cols - 1u) / tw + 1u;
+	uint32_t side = 1, area = 1, ntile = 0;
+	SyncJob2D::Order order = job.order;
+	// Squares go down a tall domain, transposed so that Hilbert ones join
+	bool tall = ty > tx;
+	if (order != SyncJob2D::order_row) {
+		while (side < min(ty, tx) && side < (1u << 16))
+			side *= 2u;
+		uint64_t nsquare = (max(ty, tx) - 1u) / side + 1u;
+		if (static_cast<uint64_t>(side) * side * nsquare > UINT_MAX) {
+			order = SyncJob2D::order_row;
+		} else {
+			area = side * side;
+			ntile = area * static_cast<uint32_t>(nsquare);
+		}
+	}
+	if (order == SyncJob2D::order_row) {
+		GK_ASSERT(static_cast<uint64_t>(ty) * tx <= UINT_MAX);
+		ntile = ty * tx;
+	}
+	auto tiles = [&](uint32_t tid, uint32_t start, uint32_t end) {
+		for (uint32_t i = start; i < end; ++i) {
+			uint32_t y, x;
+			if (order == SyncJob2D::order_row) {
+				y = i / tx, x = i % tx;
+			} else {
+				uint32_t d = i % area;
+				if (order == SyncJob2D::order_morton)
+					y = compactBits(d >> 1), x = compactBits(d);
+				else
+					hilbertCell(side, d, y, x);
+				if (tall)
+					std::swap(y, x);
+				(tall ? y : x) += i / area * side;
+			}
+			if (y >= ty || x >= tx)
+				continue;
+			uint32_t r0 = y * th, c0 = x * tw;
+			job.call(tid, r0, r0 + min(th, job.rows - r0),
+				c0, c0 + min(tw, job.cols - c0));
+		}
+	};
+	launchFor(0, ntile, tiles, job.schedule, typeid(job));
 }
 
 #if defined _WIN32
@@ -304,21 +2293,26 @@ void* SyncPool::trdRoutine(void* void_args)
 #endif
 {
 	auto wk = reinterpret_cast<Worker*>(void_args);
+	auto pool = wk->pool;
 	while (true) {
-		std::shared_ptr<JobRef> ref;
-		wk->lock.acquire();
-		while (!(wk->stop) && !(wk->ref))
-			wk->cond.wait(wk->lock);
-		if (!(wk->stop))
-			ref.swap(wk->ref);
-		wk->lock.release();
-		if (!ref)
+		bool slept = pool->epoch.wait(wk->seen, atomic_load(&(pool->spin_count)),
+			1u << (wk->index % 32));
+		atomic_fetch_add(slept ? &(wk->stat.sleep) : &(wk->stat.spin), 1u);
+		/* The main thread waits for those taking part, so their epoch stays.
+		  Others, spinning or sharing the bit, see a later one next time */
+		wk->seen = pool->epoch.load();
+		if (atomic_load(&(pool->all)) != wk->seen && atomic_load(&(wk->ticket)) != wk->seen)
+			continue;
+		atomic_store(&(wk->ticket), UINT_MAX);
+		uint32_t stop = wk->stop;
+		JobRef* ref = pool->current;
+		if (ref)
+			ref->run(*ref, wk->index);
+		// Checked in, do not touch ref and pool->current any more
+		if (pool->event.leave() == 1)
+			pool->event.wake();
+		if (stop)
 			break;
-		ref->event.enter();
-		ref->execute(wk->index);
-		// Job completed, notify the main thread
-		if (ref->event.leave() == 1)
-			ref->event.wake();
 	}
 #if defined _WIN32
 	return wk->index;
@@ -1,6 +1,14 @@
-﻿#include "atomic.hpp"
+﻿#pragma once
+
+#include "atomic.hpp"
+#include "topology.hpp"
+#include "refptr.hpp"
+#include <cerrno>
 #include <vector>
 #include <memory>
+#include <new>
+#include <typeindex>
+#include <unordered_map>
 
 namespace gk {
 
@@ -21,13 +29,22 @@ struct JobCond {
 	JobCond() { InitializeConditionVariable(&impl); }
 	~JobCond() = default;
 	void wait(JobLock& lock) { GK_ASSERT(SleepConditionVariableSRW(&impl, &(lock.impl), INFINITE, 0)); }
+	// Wait for ms at most, false if timed out
+	bool wait(JobLock& lock, uint32_t ms)
+	{
+		if (SleepConditionVariableSRW(&impl, &(lock.impl), ms, 0))
+			return true;
+		GK_ASSERT(GetLastError() == ERROR_TIMEOUT);
+		return false;
+	}
 	void signal() { WakeConditionVariable(&impl); }
 	void broadcast() { WakeAllConditionVariable(&impl); }
 };
 
 /* WaitEvent
 
-On Windows, submit and nsleep are limited to 65535.
+On Windows, submit and nsleep are limited to 65535,
+more submits at once are asserted.
 */
 class JobEvent {
 	enum {
@@ -47,12 +64,50 @@ public:
 	/* Should not on working or on sleeping */
 	~JobEvent() { GK_ASSERT(value == 0); }
 
-	void wait(uint32_t desired);
+	/* Spin `spin` times before sleeping, return whether the thread has slept */
+	bool wait(uint32_t desired, uint32_t spin = 0);
 	void wake();
-	uint32_t enter() { return atomic_fetch_add(&value, +one_value) & mask_value; }
+	uint32_t load() { return atomic_load(&value) & mask_value; }
+	uint32_t enter(uint32_t n = 1)
+	{
+		uint32_t old = atomic_fetch_add(&value, n * one_value) & mask_value;
+		// Carrying into nsleep would lose wakes
+		GK_ASSERT(n <= mask_value - old);
+		return old;
+	}
 	uint32_t leave() { return atomic_fetch_add(&value, -one_value) & mask_value; }
 };
 
+/* Generation counter, threads wait for it changing
+
+On Windows, epoch wraps at 65536 and nsleep is limited to 65535,
+bits are ignored and bump wakes all waiting threads.
+*/
+class JobEpoch {
+	enum {
+		mask_value = (1u << 16) - 1u,
+		one_sleep = 1u << 16,
+		mask_sleep = ((1u << 16) - 1u) << 16
+	};
+
+	/* Bit field
+	  - 15-0  epoch
+	  - 31-16 nsleep: The number of threads sleeping */
+	uint32_t value;
+
+public:
+	JobEpoch() { value = 0; }
+	~JobEpoch() { GK_ASSERT(!(value & mask_sleep)); }
+
+	uint32_t load() { return atomic_load(&value) & mask_value; }
+	// Epoch after the next bump, by its only caller
+	uint32_t next() { return (load() + 1u) & mask_value; }
+	/* Wait until epoch is not `seen`, return whether the thread has slept */
+	bool wait(uint32_t seen, uint32_t spin = 0, uint32_t bits = UINT_MAX);
+	/* Move to next epoch and wake all waiting threads */
+	void bump(uint32_t bits = UINT_MAX);
+};
+
 #elif defined __linux__
 
 struct JobLock {
@@ -67,9 +122,32 @@ struct JobLock {
 struct JobCond {
 	pthread_cond_t impl;
 
-	JobCond() { GK_ASSERT(!pthread_cond_init(&impl, NULL)); }
+	JobCond()
+	{
+		// Timed waits on the monotonic clock, as getTickCount
+		pthread_condattr_t attr;
+		GK_ASSERT(!pthread_condattr_init(&attr));
+		GK_ASSERT(!pthread_condattr_setclock(&attr, CLOCK_MONOTONIC));
+		GK_ASSERT(!pthread_cond_init(&impl, &attr));
+		pthread_condattr_destroy(&attr);
+	}
 	~JobCond() { GK_ASSERT(!pthread_cond_destroy(&impl)); }
 	void wait(JobLock& lock) { GK_ASSERT(!pthread_cond_wait(&impl, &(lock.impl))); }
+	// Wait for ms at most, false if timed out
+	bool wait(JobLock& lock, uint32_t ms)
+	{
+		timespec ts;
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		ts.tv_sec += ms / 1000;
+		ts.tv_nsec += static_cast<long>(ms % 1000) * 1000000;
+		if (ts.tv_nsec >= 1000000000) {
+			ts.tv_sec += 1;
+			ts.tv_nsec -= 1000000000;
+		}
+		int err = pthread_cond_timedwait(&impl, &(lock.impl), &ts);
+		GK_ASSERT(!err || err == ETIMEDOUT);
+		return !err;
+	}
 	void signal() { GK_ASSERT(!pthread_cond_signal(&impl)); }
 	void broadcast() { GK_ASSERT(!pthread_cond_broadcast(&impl)); }
 };
@@ -85,18 +163,114 @@ public:
 	JobEvent() { value = 0; }
 	~JobEvent() { GK_ASSERT(value == 0); }
 
-	void wait(uint32_t desired)
+	/* Spin `spin` times before sleeping, return whether the thread has slept */
+	bool wait(uint32_t desired, uint32_t spin = 0)
 	{
-		for (uint32_t submit; (submit = atomic_load(&value)) != desired;)
+		for (; spin && atomic_load(&value) != desired; --spin)
+			yield(1);
+		bool slept = false;
+		for (uint32_t submit; (submit = atomic_load(&value)) != desired; slept = true)
 			sysfutex(&value, FUTEX_WAIT_PRIVATE, submit, NULL, NULL, 0);
+		return slept;
 	}
 	void wake() { sysfutex(&value, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0); }
-	uint32_t enter() { return atomic_fetch_add(&value, +1); }
+	uint32_t load() { return atomic_load(&value); }
+	uint32_t enter(uint32_t n = 1) { return atomic_fetch_add(&value, n); }
 	uint32_t leave() { return atomic_fetch_add(&value, -1); }
 };
 
+/* Generation counter, threads wait for it changing
+
+The highest bit tells whether some thread sleeps,
+so that `bump` only invokes futex when necessary.
+A thread waits with bits, and is woken by a bump with any of them,
+all threads by one futex call at most.
+*/
+class JobEpoch {
+	enum : uint32_t {
+		mask_value = (1u << 31) - 1u,
+		flag_sleep = 1u << 31
+	};
+
+	uint32_t value;
+
+public:
+	JobEpoch() { value = 0; }
+	~JobEpoch() = default;
+
+	uint32_t load() { return atomic_load(&value) & mask_value; }
+	// Epoch after the next bump, by its only caller
+	uint32_t next() { return (load() + 1u) & mask_value; }
+
+	/* Wait until epoch is not `seen`, return whether the thread has slept */
+	bool wait(uint32_t seen, uint32_t spin = 0, uint32_t bits = FUTEX_BITSET_MATCH_ANY)
+	{
+		for (; spin && (atomic_load(&value) & mask_value) == seen; --spin)
+			yield(1);
+		bool slept = false;
+		uint32_t old = atomic_load(&value);
+		while ((old & mask_value) == seen) {
+			if (!(old & flag_sleep)
+				&& !atomic_compare_exchange(&value, &old, old | flag_sleep))
+				continue;
+			sysfutex(&value, FUTEX_WAIT_BITSET_PRIVATE, old | flag_sleep, NULL, NULL, bits);
+			slept = true;
+			old = atomic_load(&value);
+		}
+		return slept;
+	}
+
+	/* Move to next epoch and wake threads waiting with any of bits,
+	  others keep sleeping, so is the flag */
+	void bump(uint32_t bits = FUTEX_BITSET_MATCH_ANY)
+	{
+		uint32_t keep = bits == FUTEX_BITSET_MATCH_ANY ? 0u : static_cast<uint32_t>(flag_sleep);
+		uint32_t old = atomic_load(&value);
+		while (!atomic_compare_exchange(&value, &old, ((old + 1u) & mask_value) | (old & keep)))
+			;
+		if (old & flag_sleep)
+			sysfutex(&value, FUTEX_WAKE_BITSET_PRIVATE, INT_MAX, NULL, NULL, bits);
+	}
+};
+
 #endif
 
+/* Fixed array of n T aligned as T, for types of GK_ALIGNED(64),
+  as new T[n] is not aligned so before C++17 */
+template <typename T>
+class AlignedArray {
+public:
+	explicit AlignedArray(size_t n)
+		: ptr(static_cast<T*>(alignedAlloc(max(n, size_t(1)) * sizeof(T), GK_ALIGNOF(T)))), num(n)
+	{
+		for (size_t i = 0; i < n; ++i)
+			new (ptr + i) T();
+	}
+	AlignedArray(size_t n, T const& value)
+		: ptr(static_cast<T*>(alignedAlloc(max(n, size_t(1)) * sizeof(T), GK_ALIGNOF(T)))), num(n)
+	{
+		for (size_t i = 0; i < n; ++i)
+			new (ptr + i) T(value);
+	}
+	~AlignedArray()
+	{
+		for (size_t i = num; i--;)
+			ptr[i].~T();
+		alignedFree(ptr);
+	}
+
+	T& operator[](size_t i) const { return ptr[i]; }
+	T* data() const { return ptr; }
+	size_t size() const { return num; }
+
+private:
+	T* ptr;
+	size_t num;
+
+	AlignedArray(AlignedArray const&) = delete;
+	AlignedArray& operator=(AlignedArray const&) = delete;
+};
+
 /* Asynchronous job
 
 Before completed,
@@ -105,13 +279,23 @@ Before completed,
 Need to do job's partition and concurrency in `call`.
 
 After completed, the variable can be reused.
+Held by either std::shared_ptr or RefPtr, not both.
 */
-struct AsyncJob {
-	/* Job priority.
-	  Considered reasonably but limitedly internally,
-	  to avoid other jobs waiting for long time */
+struct AsyncJob : public RefObj {
+	/* Job priority, class min(priority, AsyncPool::NUM_CLASS - 1).
+	  Higher classes are taken more often, but never starve lower ones */
 	uint32_t priority;
 
+	/* Preferred NUMA node, NODE_ANY by default.
+	  Queued on that node, and taken by threads of that node first */
+	uint32_t node;
+	enum : uint32_t { NODE_ANY = UINT_MAX };
+
+	/* Preferred background thread by index, WORKER_ANY by default.
+	  Queued on the private queue of that thread, see AsyncPool::submitTo */
+	uint32_t worker;
+	enum : uint32_t { WORKER_ANY = UINT_MAX };
+
 	/* Indicates how many threads will work on it simultaneously.
 	  Multiple threads can wait on a same job */
 	JobEvent event;
@@ -119,50 +303,345 @@ struct AsyncJob {
 	AsyncJob();
 	virtual ~AsyncJob();
 
-	/* Implement this function
+	/* Implement one of these functions
 
 	  The function will be called as many times as the job is submitted.
+	  trd is the index of the thread doing it, see AsyncPool::getWorkerIndex,
+	  call() is called by default.
 	*/
-	virtual void call() = 0;
+	virtual void call() { }
+	virtual void call(uint32_t trd);
+
+	/* Called for each submit dropped by the pool without `call`,
+	  i.e. still queued when it is destroyed.
+	  Leaves event by default, waking waiters as if done */
+	virtual void discard();
+
+	/* Wating for job completed
 
-	/* Wating for job completed */
+	  On a thread doing jobs of the pool the job was last submitted to,
+	  the thread does jobs of that pool meanwhile, this job's first,
+	  so nested waits do not exhaust the pool. Other threads sleep.
+	  See AsyncPool::MAX_HELP_DEPTH for deeply nested waits.
+	*/
 	virtual void wait();
+
+	/* Waiting without a thread, as `co_await job` in coroutine.hpp
+
+	  `resume` is called once by the thread completing the job,
+	  or at once if completed. Do not submit the job again before that.
+	*/
+	struct Awaiter {
+		Awaiter* next;
+		void (*resume)(Awaiter* self);
+	};
+	void await(Awaiter* awaiter);
+
+	// Leave event once, waking waiters and resuming awaiters on 0
+	void leave();
+
+private:
+	// Stack of Awaiter
+	uintptr_t awaiters;
+	// AsyncPool it was last queued in, 0 if never
+	uintptr_t home;
+
+	friend struct AsyncPool;
 };
 
+template <typename R>
+class JobFuture;
+
+// co_await pool.schedule(), in coroutine.hpp
+struct AsyncSchedule;
+
 /* Asynchronous thread pool */
 struct AsyncPool {
-	enum { MAX_THREAD = 32 };
-
-	AsyncPool();
+	/* Worker storage is allocated here for max_thread threads,
+	  0 for max(32, the number of CPUs) */
+	explicit AsyncPool(uint32_t max_thread = 0);
 	~AsyncPool();
 
-	/* The number of background threads */
-	uint32_t getNumThread() const { return num_thread; }
+	/* The number of background threads, changing in elastic mode */
+	uint32_t getNumThread() const { return atomic_load(const_cast<uint32_t*>(&num_thread)); }
+	uint32_t getMaxThread() const { return max_thread; }
 
-	/* Set the number of background threads (<= MAX_THREAD)
+	/* Set the number of background threads (<= getMaxThread())
 
 	  if 0, disable asynchrony, pool will do job during submit.
 	  Thus able to get a completed stack when debug, maybe useful.
+	  Elastic mode is turned off.
 	*/
 	void setNumThread(uint32_t n);
 
+	/* Elastic mode, threads between min_thread and max_thread
+
+	  A thread is started when jobs waiting in queues reach depth per
+	  thread, or a job has waited for wait_us, and no thread is idle.
+	  It is started by a manager thread, created here and kept until
+	  destruction, woken by the thread submitting or taking that job,
+	  which never waits for it. The thread of the highest index retires
+	  after idle for idle_ms, if no job is waiting.
+	*/
+	struct Elastic {
+		uint32_t min_thread, max_thread;
+		uint32_t idle_ms;
+		uint32_t depth, wait_us;
+	};
+	void setElastic(Elastic const& elastic);
+
+	/* Pin background threads by affinity, thread i on the i-th place.
+	  Threads created later are pinned too, affinity_none to unpin.
+	  A pinned thread takes the earlier of jobs of its node and of
+	  NODE_ANY, jobs of other nodes only if there are none, or they are
+	  earlier and have waited the steal delay. An unpinned one takes
+	  the earliest of all */
+	void setAffinity(CpuAffinity const& affinity);
+
+	/* Topology for setAffinity and per-node queues,
+	  CpuTopology::system() by default. Affinity is applied again */
+	void setTopology(CpuTopology const& topology);
+	uint32_t getNumNode() const { return num_node; }
+
+	/* A job of priority 0 submitted from a background thread of this pool
+	  (i.e. in `call`) goes to the deque of the thread, taken newest first
+	  by itself and oldest first by idle threads stealing, without lock.
+	  Otherwise it is queued in FIFO of its class on its node,
+	  jobs of NODE_ANY in one shared by all nodes */
 	void submit(std::shared_ptr<AsyncJob> job);
+	/* Same, without allocation once queues have grown, where a job of
+	  std::shared_ptr is boxed in an allocation if queued by a background
+	  thread. With PooledAsyncJob, jobs are not allocated either */
+	void submit(RefPtr<AsyncJob> job);
+
+	/* Run f() on the pool, its result given by the future.
+	  f and the result are stored in one job, pooled per type of f,
+	  so no allocation in steady state */
+	template <typename F>
+	auto async(F f) -> JobFuture<decltype(f())>;
+
+	// Awaitable resuming the coroutine on a thread of this pool
+	AsyncSchedule schedule();
+
+	/* Submit to the private queue of thread `worker`, as setting job.worker
+
+	  The thread takes them in FIFO after its own deque, before other
+	  queues, whatever the priority. Others take a job only after it has
+	  waited for the steal delay. If there is no such thread now, the
+	  job is queued as without preference.
+	*/
+	void submitTo(uint32_t worker, std::shared_ptr<AsyncJob> job);
+	void submitTo(uint32_t worker, RefPtr<AsyncJob> job);
+	// 1000 us by default, UINT_MAX to take jobs from their threads only
+	void setStealDelay(uint32_t us);
+
+	/* Spin count before sleeping, both for threads in `wait` finding
+	  nothing to do and for idle threads waiting for jobs.
+	  Each spin is one `yield`, idle threads looking for jobs again. 64 by default */
+	uint32_t getSpinCount() const { return spin_count; }
+	void setSpinCount(uint32_t n) { atomic_store(&spin_count, n); }
+
+	/* How waits ended, summed over all threads
+	  - spin  : the job or event is done before or during spinning
+	  - sleep : went to sleep, fell back to futex or condition variable */
+	struct WaitStat {
+		uint64_t spin, sleep;
+	};
+	WaitStat getWaitStat() const;
+	void resetWaitStat();
+
+	/* Index of the calling background thread of this pool, in
+	  [0, getMaxThread()), for data of each thread indexed by it.
+	  getMaxThread() on other threads, e.g. doing jobs in `wait`.
+	  One of them at a time does jobs, others only sleep meanwhile,
+	  so the index is private to a job while it runs, unless there is
+	  no background thread: then jobs are done at once by those submitting
+	  them, all with getMaxThread().
+	  Passed to AsyncJob::call without looking it up */
+	uint32_t getWorkerIndex() const;
+
+	/* Submit a job after delay_ms, or every period_ms from period_ms on
+
+	  Timers are kept in a hierarchical wheel of 1 ms ticks, checked by
+	  background threads, one of idle ones sleeping until the earliest.
+	  Without background threads, they wait for some to be created.
+	  Pending timers are not counted by `wait`, jobs submitted by them are.
+	  A periodic job is submitted again even if it is still running.
+	  Delays are less than 2^31 ms, and at least that long, late by up to
+	  1 ms of the wheel and waking. Returns an id to cancel, never 0.
+	*/
+	uint64_t submitAfter(std::shared_ptr<AsyncJob> job, uint32_t delay_ms);
+	uint64_t submitAfter(RefPtr<AsyncJob> job, uint32_t delay_ms);
+	uint64_t submitEvery(std::shared_ptr<AsyncJob> job, uint32_t period_ms);
+	uint64_t submitEvery(RefPtr<AsyncJob> job, uint32_t period_ms);
+	// Remove a pending timer, false if already fired or cancelled
+	bool cancel(uint64_t timer);
+	uint32_t getNumTimer() const { return ntimer; }
+
+	/* Submit a job `times` times, or `count` jobs, as many submits but
+	  queued under one lock, and waking min(count, idle threads) threads.
+	  On Windows, 65535 submits at most are not completed at once,
+	  of a job and of all jobs of a pool */
+	void submit(std::shared_ptr<AsyncJob> job, uint32_t times);
+	void submit(RefPtr<AsyncJob> job, uint32_t times);
+	void submitBatch(std::shared_ptr<AsyncJob> const* jobs, uint32_t count);
+	void submitBatch(RefPtr<AsyncJob> const* jobs, uint32_t count);
+
+	/* Bound of jobs waiting in the shared queues, 0 for unbounded by default
+
+	  Only those queues are bounded: jobs in deques of threads, inboxes of
+	  submitTo and those submitted by timers are neither counted nor
+	  refused. Once queues are full, submit
+	  - overflow_block : waits until threads take jobs
+	  - overflow_inline : does the job on the calling thread
+	  A background thread of this pool does the job rather than waits,
+	  lest all threads wait for each other. So does any thread while there
+	  is no thread to take jobs, and none is to be started in elastic mode.
+	*/
+	enum Overflow { overflow_block, overflow_inline };
+	void setCapacity(uint32_t capacity, Overflow overflow = overflow_block);
+	uint32_t getCapacity() const { return capacity; }
+	// Submit unless queues are full, never waiting, false if not submitted
+	bool trySubmit(std::shared_ptr<AsyncJob> job);
+	bool trySubmit(RefPtr<AsyncJob> job);
+
+	/* Priority classes, FIFO each
+
+	  Classes are taken by weighted round-robin, class c has weight 4^c:
+	  of every 85 jobs taken while all classes are waiting,
+	  64 are from class 3 and 1 from class 0.
+	  Threads take jobs of classes above 0 before their own deques.
+	*/
+	enum { NUM_CLASS = 4 };
+
+	/* Counters of a class, except jobs in deques
+	  - depth : jobs waiting now
+	  - count : jobs taken
+	  - wait_us, max_wait_us : total and longest wait of jobs taken */
+	struct QueueStat {
+		uint64_t depth, count;
+		double wait_us, max_wait_us;
+	};
+	QueueStat getQueueStat(uint32_t cls);
+	void resetQueueStat();
 
 	/* Waiting all submitted jobs completed
 
 	  Jobs submitted during waiting are not be guaranteed completed.
+	  The calling thread does queued jobs meanwhile.
+	  Not from a job of this pool, which would wait for itself.
 	*/
 	void wait();
+	/* Waiting a job completed, doing jobs of this pool meanwhile,
+	  this job's first. From any thread, as AsyncJob::wait on this pool */
+	void wait(AsyncJob& job);
+	// Waiting ev reaches 0, doing jobs of this pool meanwhile
+	void wait(JobEvent& ev);
+
+	/* Waits doing any job nested in jobs done by waits, on one thread.
+	  Deeper ones do only jobs their thread queued and the job waited for,
+	  sleeping otherwise, not to overflow the stack by unrelated jobs */
+	enum { MAX_HELP_DEPTH = 16 };
 
 private:
+	// A job held by shared_ptr or RefPtr
+	struct JobPtr {
+		std::shared_ptr<AsyncJob> shared;
+		RefPtr<AsyncJob> ref;
+
+		AsyncJob* get() const { return ref ? ref.get() : shared.get(); }
+		AsyncJob* operator->() const { return get(); }
+		explicit operator bool() const { return ref || shared; }
+	};
+
 	struct IdJob {
 		uint32_t id;
-		std::shared_ptr<AsyncJob> job;
-		bool operator<(IdJob const& rhs) const { return id > rhs.id; }
+		// When it is queued
+		int64_t tick;
+		JobPtr job;
+	};
+
+	/* FIFO of IdJob in 2^k slots, only growing,
+	  so no allocation once as deep as the deepest queue so far */
+	class IdRing {
+	public:
+		IdRing() : head(0), num(0) { }
+
+		bool empty() const { return !num; }
+		size_t size() const { return num; }
+		// The i-th from the front
+		IdJob& operator[](size_t i) { return slots[(head + i) & (slots.size() - 1)]; }
+		IdJob& front() { return (*this)[0]; }
+		void push_back(IdJob it);
+		void pop_front();
+		// Remove the i-th, moving those before it
+		void erase(size_t i);
+
+	private:
+		std::vector<IdJob> slots;
+		size_t head, num;
+	};
+
+	struct ClassStat {
+		uint64_t depth, count;
+		int64_t wait, max_wait;
+	};
+
+	enum : uint32_t {
+		TIMER_BITS = 6,
+		TIMER_SLOT = 1u << TIMER_BITS,
+		TIMER_LEVEL = 4,
+		TIMER_NONE = UINT_MAX
+	};
+
+	/* Level l slot s holds timers due in its 64^l ms, cascaded to lower
+	  levels when the wheel reaches it. Timers due beyond 64^4 ms wait in
+	  level 3 for rounds. Linked by index, free ones by `next` */
+	struct Timer {
+		JobPtr job;
+		// In ms of the wheel, period 0 if once
+		uint32_t due, period;
+		uint32_t prev, next;
+		// Bumped on free, of ids
+		uint32_t gen;
+		// level * TIMER_SLOT + slot, TIMER_NONE if not pending
+		uint32_t slot;
+	};
+
+	/* Chase-Lev work-stealing deque of non-zero items
+	  The owner pushes and takes at bottom, others steal at top.
+	  Indices wrap, at most 2^31 items.
+	  https://fzn.fr/readings/ppopp13.pdf */
+	struct Deque {
+		struct Ring {
+			uint32_t mask;
+			std::unique_ptr<uintptr_t[]> slots;
+		};
+
+		GK_ALIGNED(64) uint32_t top;
+		GK_ALIGNED(64) uint32_t bottom;
+		// Current Ring
+		uintptr_t ring;
+		// Thieves may read an old ring, so all are kept until destruction
+		std::vector<std::unique_ptr<Ring>> rings;
+
+		Deque();
+		// Owner only
+		void push(uintptr_t item);
+		// Owner only, 0 if empty
+		uintptr_t take();
+		// 0 if empty or lost to another thread
+		uintptr_t steal();
+		bool empty() const;
 	};
 
-	struct Worker {
+	// One cache line each at least
+	struct GK_ALIGNED(64) Worker {
 		uint32_t index, stop;
+		// Node of the queue taken first, NODE_ANY if not pinned
+		uint32_t node;
+		// Of xorshift choosing victims
+		uint32_t seed;
 		AsyncPool* pool;
 #if defined _WIN32
 		unsigned win32_id;
@@ -170,38 +649,576 @@ private:
 #elif defined __linux__
 		pthread_t thread;
 #endif
+		// Whether thread is to be joined, maybe exited by itself
+		bool joinable;
+		// Time of the wheel when it was last busy, in elastic mode
+		uint32_t active_ms;
+		// Whether it is in sleepers, woken by cond alone, guarded by work_lock
+		bool sleeping;
+		JobCond cond;
+		/* Jobs submitted to this thread, guarded by work_lock,
+		  their number read without lock */
+		IdRing inbox;
+		uint32_t ninbox;
+		/* Jobs submitted by this thread, AsyncJob* with a reference of RefPtr
+		  if bit 0 set, otherwise boxed std::shared_ptr<AsyncJob> */
+		Deque deque;
+		WaitStat stat;
 	};
 
-	uint32_t num_thread;
+	uint32_t num_thread, max_thread;
+	uint32_t spin_count;
+	// Of threads out of the pool
+	WaitStat wait_stat;
 	uint32_t current_id;
+	/* The number of threads going to sleep, jobs in waitlists,
+	  and those of classes above 0.
+	  Written with work_lock held, read without it to skip locking */
+	uint32_t nidle, ninject, nurgent;
+	uint32_t num_node;
 	// The number of jobs not completed
 	JobEvent event;
-	Worker workers[MAX_THREAD];
+	AlignedArray<Worker> workers;
 	JobLock pool_lock, work_lock;
-	JobCond work_cond;
-	std::vector<IdJob> waitlist;
+	// Indices of sleeping threads, the latest last, guarded by work_lock
+	std::vector<uint32_t> sleepers;
+	/* Thread out of the pool holding the slot max_thread, 0 if none,
+	  and how many times it is held by it, nested in jobs */
+	uintptr_t slot_owner;
+	uint32_t slot_depth;
+	/* FIFO of class c on node n is waitlists[n * NUM_CLASS + c],
+	  n = num_node for NODE_ANY, with credits of round-robin and counters, guarded by work_lock */
+	std::vector<IdRing> waitlists;
+	uint32_t credits[NUM_CLASS];
+	ClassStat stats[NUM_CLASS];
+	/* Bound of ninject and producers waiting for room, guarded by work_lock,
+	  space_cond signaled as jobs are taken while some are waiting */
+	uint32_t capacity, nblocked;
+	Overflow overflow;
+	JobCond space_cond;
+	/* Jobs in all inboxes, written with work_lock held,
+	  and how long before others take them */
+	uint32_t nprivate;
+	uint32_t steal_us;
+	int64_t steal_ticks;
+	// Timer wheel, guarded by work_lock
+	std::vector<Timer> timers;
+	uint32_t timer_free;
+	uint32_t timer_head[TIMER_LEVEL * TIMER_SLOT];
+	uint64_t timer_used[TIMER_LEVEL];
+	// All timers due by timer_now are fired
+	uint32_t timer_now;
+	// When the wheel is to be advanced, and pending timers, read without lock
+	uint32_t timer_due, ntimer;
+	/* Idle thread sleeping until timer_due, or jobs of inboxes can be
+	  taken by others, UINT_MAX if none */
+	uint32_t keeper;
+	int64_t timer_base;
+	/* Elastic mode, changed with work_lock held.
+	  num_thread is changed with work_lock held in elastic mode,
+	  growing is set from grow until the manager has started a thread */
+	Elastic elastic;
+	uint32_t elastic_on, growing;
+	/* Thread starting others for grow, sleeping on grow_cond with
+	  work_lock until growing or manager_stop is set */
+#if defined _WIN32
+	uintptr_t manager;
+#elif defined __linux__
+	pthread_t manager;
+#endif
+	bool has_manager, manager_stop;
+	JobCond grow_cond;
+	// Waiting of the last job taken from waitlists
+	uint32_t last_wait_us;
+	CpuTopology topo;
+	CpuAffinity affinity;
+	// CPU of each thread, empty if not pinned
+	std::vector<uint32_t> places;
+
+	// Place and pin threads by affinity on topo, pool_lock held
+	void applyAffinity();
+	// Places and topo are not changed meanwhile
+	void startThread(uint32_t i);
+	void joinThread(uint32_t i);
+	// Whether submit does jobs at once, no thread in manual mode
+	bool inlined() { return atomic_load(&num_thread) < 1 && !atomic_load(&elastic_on); }
+	// Whether waitlists are full, work_lock held
+	bool full() const { return capacity && ninject >= capacity; }
+	// Whether no thread takes jobs of waitlists, nor will be started, work_lock held
+	bool stalled() const { return !num_thread && !(elastic_on && elastic.max_thread); }
+	// Wait until waitlists are not full or stalled, work_lock held
+	void waitSpace();
+	// Whether job goes to an inbox, work_lock held
+	bool toInbox(AsyncJob const& job) const
+	{
+		return job.worker < num_thread && !workers[job.worker].stop;
+	}
+	bool trySubmitJob(JobPtr job);
+	// Job of the inbox of wk, the front if it is older than steal_ticks for others
+	JobPtr takeInbox(Worker& wk, bool own);
+	// Whether to start a thread in elastic mode, read without lock
+	bool needGrow();
+	// Wake the manager to start a thread, unless it is starting one
+	void grow();
+	// Body of the manager
+	void manage();
+	// Whether the idle thread is to retire in elastic mode, work_lock held
+	bool retiring(Worker const& wk) const
+	{
+		return elastic_on && wk.index + 1 == num_thread && num_thread > elastic.min_thread;
+	}
+	// Deque items of jobs and back
+	static uintptr_t toItem(JobPtr job);
+	static JobPtr fromItem(uintptr_t item);
+	void submitTimes(JobPtr const& job, uint32_t times);
+	// Queue at(i) for i in [0, count), events of jobs entered
+	template <typename F>
+	void submitJobs(uint32_t count, F const& at);
+	// Queue a job, work_lock held
+	void put(IdJob it);
+	// Pop a job for a thread of node, work_lock held
+	JobPtr take(uint32_t node);
+	// take with work_lock
+	JobPtr takeLocked(Worker& wk);
+	// The own deque, then waitlists, then deques of others
+	JobPtr find(Worker& wk);
+	JobPtr steal(Worker& wk);
+	// Sleep until some job may be there, return false to stop
+	bool idle(Worker& wk);
+	// Wake the latest to sleep, or wk if sleeping, work_lock held
+	void wakeOne();
+	void wake(Worker& wk);
+	void wakeAll();
+	// Remove wk from sleepers, false if not there, work_lock held
+	bool unsleep(Worker& wk);
+	/* Index to do jobs with on this thread, the slot max_thread out of
+	  the pool, or UINT_MAX if held by another thread */
+	uint32_t enterSlot();
+	void leaveSlot(uint32_t index);
+	// Time of the wheel, in ms rounded down
+	uint32_t timerClock() const;
+	// Exact ms from tick until the wheel reaches due
+	double timerLeft(uint32_t due, int64_t tick) const;
+	uint64_t addTimer(JobPtr job, uint32_t delay_ms, uint32_t period_ms);
+	// Link into the wheel by due, work_lock held
+	void linkTimer(uint32_t index);
+	void unlinkTimer(uint32_t index);
+	// Earliest time to advance the wheel
+	uint32_t nextDue() const;
+	// Advance the wheel to now and queue jobs due, work_lock held
+	void fireTimers();
+	void fireSlot(uint32_t slot);
+	void run(JobPtr const& job, uint32_t index);
+	/* Do jobs until ev reaches 0, target's first, then others.
+	  Sleep on ev only when none is found. wk is null out of the pool */
+	void help(JobEvent& ev, AsyncJob* target, Worker* wk);
+	// Pop target from the first scan jobs of waitlists, work_lock held
+	JobPtr takeTarget(AsyncJob* target, size_t scan);
+	// Pop it of class cls, work_lock held
+	JobPtr pop(IdRing& list, size_t i, uint32_t cls);
+
+	friend struct AsyncJob;
+	friend struct JobGraph;
 
 #if defined _WIN32
 	static unsigned __stdcall trdRoutine(void* void_args);
+	static unsigned __stdcall mgrRoutine(void* void_args);
 #elif defined __linux__
 	static void* trdRoutine(void* void_args);
+	static void* mgrRoutine(void* void_args);
 #endif
 };
 
+/* AsyncJob recycled by freelists instead of deleted, held by RefPtr
+
+	struct MyJob : public PooledAsyncJob<MyJob> { ... };
+	RefPtr<MyJob> job = MyJob::make();
+	pool.submit(job);
+
+A released job goes to the freelist of the releasing thread. Beyond
+2 * BATCH jobs, BATCH of them move to a list shared by all threads,
+where a thread with an empty freelist takes a batch from. So jobs made
+on one thread and released on others are reused too, without malloc.
+
+`make` returns a job as it was released, reset its fields before use.
+Base is AsyncJob or a class derived from it.
+*/
+template <typename T, typename Base = AsyncJob>
+struct PooledAsyncJob : public Base {
+	enum : uint32_t { BATCH = 64 };
+
+	static RefPtr<T> make()
+	{
+		List& local = getLocal();
+		if (!local.head) {
+			Shared& shared = getShared();
+			shared.lock.acquire();
+			if (!shared.batches.empty()) {
+				local = shared.batches.back();
+				shared.batches.pop_back();
+			}
+			shared.lock.release();
+		}
+		T* obj = local.pop();
+		return RefPtr<T>(obj ? obj : new T());
+	}
+
+	void destory() override
+	{
+		List& local = getLocal();
+		local.push(static_cast<T*>(this));
+		if (local.count < 2 * BATCH)
+			return;
+		List batch;
+		for (uint32_t i = BATCH; i--;)
+			batch.push(local.pop());
+		Shared& shared = getShared();
+		shared.lock.acquire();
+		shared.batches.push_back(batch);
+		shared.lock.release();
+	}
+
+private:
+	PooledAsyncJob* next_free;
+
+	struct List {
+		PooledAsyncJob* head;
+		uint32_t count;
+
+		List() : head(nullptr), count(0) { }
+		void push(PooledAsyncJob* obj)
+		{
+			obj->next_free = head;
+			head = obj;
+			++count;
+		}
+		T* pop()
+		{
+			PooledAsyncJob* obj = head;
+			if (obj) {
+				head = obj->next_free;
+				--count;
+			}
+			return static_cast<T*>(obj);
+		}
+		void clear()
+		{
+			while (T* obj = pop())
+				delete obj;
+		}
+	};
+
+	struct Shared {
+		JobLock lock;
+		std::vector<List> batches;
+
+		~Shared()
+		{
+			for (List& list : batches)
+				list.clear();
+		}
+	};
+
+	// Of the thread, given to the shared list when the thread exits
+	struct Local : public List {
+		Local() { getShared(); }
+		~Local()
+		{
+			if (!this->head)
+				return;
+			Shared& shared = getShared();
+			shared.lock.acquire();
+			shared.batches.push_back(*this);
+			shared.lock.release();
+		}
+	};
+
+	static Shared& getShared()
+	{
+		static Shared shared;
+		return shared;
+	}
+
+	static List& getLocal()
+	{
+		// Constructed after the shared one, so destroyed before it
+		static thread_local Local local;
+		return local;
+	}
+};
+
+/* Graph of AsyncJob on AsyncPool
+
+	JobGraph graph;
+	uint32_t a = graph.add(load), b = graph.add(decode), c = graph.add(draw);
+	graph.precede(a, b);
+	graph.precede(b, c);
+	graph.run(pool);
+	graph.wait();
+
+Jobs are called once per run, by the graph not submitted, so their events
+are not used. A job is queued by the thread completing its last
+predecessor, to its own deque. Built once, a graph can run many times,
+each run only resets counters. Edges can not be changed while running.
+*/
+struct JobGraph {
+	JobGraph();
+	~JobGraph();
+
+	// Add a node, returns its index
+	uint32_t add(std::shared_ptr<AsyncJob> job);
+	// `to` starts after `from` completed
+	void precede(uint32_t from, uint32_t to);
+	uint32_t size() const { return static_cast<uint32_t>(tasks.size()); }
+
+	// Submit nodes without predecessors, to run the graph once
+	void run(AsyncPool& pool);
+	// Waiting the run completed, doing jobs of the pool meanwhile
+	void wait();
+
+private:
+	struct Task : public AsyncJob {
+		JobGraph* graph;
+		std::shared_ptr<AsyncJob> job;
+		std::vector<uint32_t> succs;
+		uint32_t ndep, pending;
+
+		void call(uint32_t trd) override;
+	};
+
+	std::vector<RefPtr<Task>> tasks;
+	std::vector<uint32_t> roots;
+	// Whether roots are out of date and the graph is to be checked
+	bool dirty;
+	AsyncPool* pool;
+	// Tasks not completed in this run
+	JobEvent event;
+};
+
+/* Job of JobFuture, completed once
+
+`done` is 1 until completed. Continuations are a stack of jobs, each
+holding a reference of RefPtr, which is swapped for DONE on completion.
+The thread completing the job submits them, later ones are submitted by
+`attach` at once.
+A job discarded by the pool is abandoned instead: `done` is left without
+a value, and so are continuations, which hold references of this one.
+*/
+struct FutureBase : public AsyncJob {
+	enum : uintptr_t { DONE = 1 };
+
+	AsyncPool* pool;
+	JobEvent done;
+	uintptr_t conts;
+	FutureBase* next_cont;
+	// Completed without a value
+	bool abandoned;
+
+	// Reset for a new run on pl
+	void init(AsyncPool* pl);
+	// After the result is set
+	void complete();
+	// Submit cont after this completed
+	void attach(RefPtr<FutureBase> cont);
+	void discard() override;
+	// Complete without a value, FutureJob drops its function too
+	virtual void abandon();
+};
+
+// Result of a future, nothing for void
+template <typename R>
+struct FutureValue {
+	alignas(R) unsigned char buf[sizeof(R)];
+	bool has = false;
+
+	template <typename F>
+	void set(F& f)
+	{
+		new (buf) R(f());
+		has = true;
+	}
+	R& get() { return *reinterpret_cast<R*>(buf); }
+	template <typename G>
+	auto apply(G& g) -> decltype(g(std::declval<R&>())) { return g(get()); }
+	void reset()
+	{
+		if (has)
+			get().~R();
+		has = false;
+	}
+};
+
+template <>
+struct FutureValue<void> {
+	template <typename F>
+	void set(F& f) { f(); }
+	void get() { }
+	template <typename G>
+	auto apply(G& g) -> decltype(g()) { return g(); }
+	void reset() { }
+};
+
+template <typename R>
+struct FutureState : public FutureBase {
+	FutureValue<R> value;
+};
+
+// Runs f once into the value, pooled per R and F
+template <typename R, typename F>
+struct FutureJob : public PooledAsyncJob<FutureJob<R, F>, FutureState<R>> {
+	alignas(F) unsigned char fbuf[sizeof(F)];
+	bool armed = false;
+
+	F& func() { return *reinterpret_cast<F*>(fbuf); }
+
+	void init(AsyncPool* pl, F&& f)
+	{
+		FutureBase::init(pl);
+		new (fbuf) F(std::move(f));
+		armed = true;
+	}
+
+	void call() override
+	{
+		this->value.set(func());
+		func().~F();
+		armed = false;
+		this->complete();
+	}
+
+	void abandon() override
+	{
+		// Releasing the future it continues
+		if (armed) {
+			func().~F();
+			armed = false;
+		}
+		FutureBase::abandon();
+	}
+
+	void destory() override
+	{
+		this->value.reset();
+		// Never submitted
+		if (armed)
+			abandon();
+		PooledAsyncJob<FutureJob<R, F>, FutureState<R>>::destory();
+	}
+};
+
+/* Result of AsyncPool::async or of `then`
+
+	JobFuture<int> a = pool.async([] { return 6; });
+	JobFuture<int> b = a.then([](int& v) { return v * 7; });
+	int v = b.get();
+
+`then` runs its function with the result on the same pool after this
+completed, from the thread completing it, without blocking any thread.
+Its function takes R& (nothing for void) and may return void.
+A future still queued when the pool is destroyed, and futures after it,
+become ready without a value, and `get` asserts.
+*/
+template <typename R>
+class JobFuture {
+	RefPtr<FutureState<R>> state;
+
+public:
+	JobFuture() { }
+	explicit JobFuture(RefPtr<FutureState<R>> st) : state(std::move(st)) { }
+
+	bool valid() const { return static_cast<bool>(state); }
+	bool ready() const { return !state->done.load(); }
+
+	// Waiting the result, doing jobs of the pool meanwhile
+	typename std::add_lvalue_reference<R>::type get()
+	{
+		state->pool->wait(state->done);
+		GK_ASSERT(!state->abandoned);
+		return state->value.get();
+	}
+	void wait() { state->pool->wait(state->done); }
+
+	template <typename F>
+	auto then(F f) -> JobFuture<decltype(std::declval<FutureValue<R>&>().apply(f))>
+	{
+		typedef decltype(std::declval<FutureValue<R>&>().apply(f)) U;
+		RefPtr<FutureState<R>> st = state;
+		auto g = [st, f]() mutable { return st->value.apply(f); };
+		typedef FutureJob<U, decltype(g)> Job;
+		RefPtr<Job> job = Job::make();
+		job->init(state->pool, std::move(g));
+		state->attach(RefPtr<FutureBase>(job));
+		return JobFuture<U>(RefPtr<FutureState<U>>(job));
+	}
+};
+
+template <typename F>
+auto AsyncPool::async(F f) -> JobFuture<decltype(f())>
+{
+	typedef decltype(f()) R;
+	RefPtr<FutureJob<R, F>> job = FutureJob<R, F>::make();
+	job->init(this, std::move(f));
+	JobFuture<R> future {RefPtr<FutureState<R>>(job)};
+	submit(RefPtr<AsyncJob>(job));
+	return future;
+}
+
+/* Freelists of coroutine frames, by 64 bytes up to MAX_SIZE
+
+As PooledAsyncJob, a thread keeps frames it freed, and gives them to
+other threads through a shared list in batches. Larger frames are not
+pooled.
+*/
+struct FramePool {
+	enum : size_t { MAX_SIZE = 4096 };
+
+	static void* alloc(size_t size);
+	static void free(void* ptr, size_t size);
+};
+
 /* Synchronous job, same to cv::ParLoopBody */
 struct SyncJob {
+	/* How the range is distributed among threads
+	  - sched_dynamic : all threads take slices from one shared index
+	  - sched_steal   : each thread starts with its own contiguous share,
+	      and steals half of the remaining of another one when idle.
+	      maxcall only decides the slice size here
+	  - sched_static  : thread tid does exactly the tid-th contiguous share,
+	      as OpenMP schedule(static)
+	  - sched_affinity: as sched_static, but idle threads steal one slice at
+	      a time from the tail of others, as tbb::affinity_partitioner.
+	  With the same range and thread count, a share goes to the same thread
+	  on every submit, so its data stays in that core's cache
+	  - sched_auto    : as sched_dynamic, but the slice size is tuned to take
+	      about AUTO_SLICE_US by timing each slice, and is never more than
+	      half of a thread's part of the remaining (guided).
+	      The tuned size is kept per job type for the next submit.
+	      maxcall is ignored */
+	enum Schedule : uint32_t {
+		sched_dynamic = 0,
+		sched_steal,
+		sched_static,
+		sched_affinity,
+		sched_auto,
+	};
+
+	// Target time of one slice for sched_auto, in microseconds
+	enum { AUTO_SLICE_US = 100 };
+
 	/* The number of invorking `call` at most
 	  - 0 : dynamically decide internally. starting from 1/4 now
 	  - 1 : only the main thread do job
 	  - other : min(maxcall, allend - allstart) */
 	uint32_t maxcall;
 
+	Schedule schedule;
+
 	/* start and end of job range
 	  (allend - allstart) * min(maxcall, num_thread) <= UINT_MAX */
 	uint32_t allstart, allend;
 
 	SyncJob()
-		: maxcall(0), allstart(0), allend(0) { }
+		: maxcall(0), schedule(sched_dynamic), allstart(0), allend(0) { }
 
 	virtual ~SyncJob() = default;
 
@@ -216,44 +1233,269 @@ struct SyncJob {
 	virtual void call(uint32_t tid, uint32_t start, uint32_t end) = 0;
 };
 
+/* Synchronous job on a 64-bit range
+
+Same to SyncJob, for ranges longer than UINT_MAX.
+A range longer than MAX_BLOCK is cut into MAX_BLOCK blocks of about equal
+size, slices are made of whole blocks and maxcall counts blocks.
+Otherwise it is done exactly as SyncJob, on the same 32-bit counters.
+*/
+struct SyncJob64 {
+	enum : uint32_t { MAX_BLOCK = 1u << 31 };
+
+	// The number of invorking `call` at most, same to SyncJob
+	uint32_t maxcall;
+	SyncJob::Schedule schedule;
+	// start and end of job range
+	uint64_t allstart, allend;
+
+	SyncJob64()
+		: maxcall(0), schedule(SyncJob::sched_dynamic), allstart(0), allend(0) { }
+
+	virtual ~SyncJob64() = default;
+
+	/* Implement this function
+
+	  @param tid   the index of thread doing this call, starting from 0
+	  @param start the start of slice, inclusively
+	  @param end   the end   of slice, exclusively
+	*/
+	virtual void call(uint32_t tid, uint64_t start, uint64_t end) = 0;
+};
+
+/* Synchronous job on rows x cols, done by tiles
+
+Tiles are the unit of scheduling, numbered in `order`.
+Morton and Hilbert walk power-of-2 squares of tiles, as wide as the
+short side, one after another along the long side. Tiles out of domain
+are skipped. Hilbert squares join end to start.
+Row order is taken if the squares have more than 2^32 tiles.
+*/
+struct SyncJob2D {
+	enum Order : uint32_t {
+		order_row = 0,
+		order_morton,
+		order_hilbert,
+	};
+
+	// Size of domain
+	uint32_t rows, cols;
+	// Size of tile, the last row or column of tiles may be smaller
+	uint32_t tile_rows, tile_cols;
+	Order order;
+	SyncJob::Schedule schedule;
+
+	SyncJob2D()
+		: rows(0), cols(0), tile_rows(64), tile_cols(64),
+			order(order_row), schedule(SyncJob::sched_dynamic) { }
+
+	virtual ~SyncJob2D() = default;
+
+	/* Implement this function
+
+	  Invorked once for each tile [r0, r1) x [c0, c1)
+	  @param tid the index of thread doing this call, starting from 0
+	*/
+	virtual void call(uint32_t tid,
+		uint32_t r0, uint32_t r1, uint32_t c0, uint32_t c1)
+		= 0;
+};
+
 /* Synchronous thread pool, same to cv::parallel_for_ */
 struct SyncPool {
-	enum { MAX_THREAD = 32 };
-
-	SyncPool();
+	/* Worker storage is allocated here for max_thread threads
+	  including the main, 0 for max(32, the number of CPUs) */
+	explicit SyncPool(uint32_t max_thread = 0);
 	~SyncPool();
 
 	/* The number of working threads (background + the main) */
 	uint32_t getNumThread() const { return num_worker + 1; }
+	uint32_t getMaxThread() const { return max_worker + 1; }
 
-	/* Set the number of working threads (<= MAX_THREAD), including the main
+	/* Set the number of working threads (<= getMaxThread()), including the main
 
 	  if 0 or 1, disable concurrency, pool will do job during submit.
 	  Thus able to get a completed stack when debug, maybe useful.
 	*/
 	void setNumThread(uint32_t n);
 
-	/* Do a job, and return */
+	/* Pin threads by affinity, thread tid on the tid-th place
+
+	  The calling thread is taken as the main thread. It does the last tid
+	  of a job using all threads, i.e. getNumThread() - 1, so it is pinned
+	  to that place, here only: call again after setNumThread to move it.
+	  Threads created later are pinned too, affinity_none to unpin.
+	  The thread destroying the pool is unpinned.
+	  Shares of sched_steal, sched_static and sched_affinity are ordered
+	  by the node of threads, so that each node does one contiguous part,
+	  and idle threads steal from their node first.
+	*/
+	void setAffinity(CpuAffinity const& affinity);
+
+	/* Topology for setAffinity, CpuTopology::system() by default.
+	  Affinity is applied again */
+	void setTopology(CpuTopology const& topology);
+
+	/* Spin count before sleeping, both for the main thread waiting for
+	  other threads and for idle threads waiting for jobs.
+	  Each spin is one `yield`. 0 (default) to sleep at once */
+	uint32_t getSpinCount() const { return spin_count; }
+	void setSpinCount(uint32_t n) { atomic_store(&spin_count, n); }
+
+	/* How waits ended, summed over all threads
+	  - spin  : the condition is met before or during spinning
+	  - sleep : fell back to futex (keyed event on Windows) */
+	struct WaitStat {
+		uint64_t spin, sleep;
+	};
+	WaitStat getWaitStat() const;
+	void resetWaitStat();
+
+	/* Do a job, and return
+
+	  Only threads taking part, as many as the range and maxcall allow,
+	  are woken, all by one futex call, and the main thread does not
+	  return before each of them has checked in. The pool is not locked
+	  meanwhile, setNumThread waits for the job.
+	  A job submitted while another one is running (nested in `call`,
+	  or from another thread) is done by the calling thread alone with tid 0.
+	*/
 	void submit(SyncJob& job);
+	void submit(SyncJob2D& job);
+	void submit(SyncJob64& job);
+
+	/* Same to submit, without virtual call and heap allocation
+
+	  body(uint32_t tid, uint32_t start, uint32_t end) is inlined into
+	  the loop taking slices, and the job state lives on the stack.
+	  SyncJob is still the type-erased way to do the same thing.
+	*/
+	template <typename F>
+	void parallel_for(uint32_t begin, uint32_t end, F&& body,
+		SyncJob::Schedule schedule = SyncJob::sched_dynamic);
+
+	/* parallel_for on a 64-bit range, as SyncJob64
+	  body(uint32_t tid, uint64_t start, uint64_t end) */
+	template <typename F>
+	void parallel_for64(uint64_t begin, uint64_t end, F&& body,
+		SyncJob::Schedule schedule = SyncJob::sched_dynamic);
+
+	/* Reduce [begin, end) to one value
+
+	  body(T& acc, uint32_t start, uint32_t end) folds a slice into acc,
+	  combine(T& acc, T const& other) merges other into acc.
+	  Every accumulator starts from init, in its own cache line,
+	  and they are combined pairwise as a tree of fixed shape.
+	  - deterministic = false : one accumulator per thread, getMaxThread() of them
+	      as setNumThread may run meanwhile
+	  - deterministic = true  : one per block, blocks only depend on the range.
+	      The result is the same whatever thread count or schedule,
+	      e.g. reproducible floating-point sums.
+	*/
+	template <typename T, typename Body, typename Combine>
+	T reduce(uint32_t begin, uint32_t end, T const& init,
+		Body&& body, Combine&& combine, bool deterministic = false,
+		SyncJob::Schedule schedule = SyncJob::sched_dynamic);
+
+	// The number of blocks of deterministic reduce
+	enum { REDUCE_BLOCK = 256 };
+
+	/* Prefix sum of in[0, n) to out[0, n), in and out can be the same
+
+	  - exclusive : out[i] = init op in[0] op ... op in[i - 1]
+	  - inclusive : out[i] = init op in[0] op ... op in[i]
+	  op(T const& a, T const& b) must be associative.
+	  Two passes by blocks of SCAN_BYTES: threads sum up each block,
+	  then each block is scanned again starting from the sum before it.
+	*/
+	template <typename T, typename Op>
+	void scan(T const* in, T* out, uint32_t n, T const& init,
+		Op&& op, bool inclusive = false);
+
+	// Block size of scan, in bytes, about half of L2
+	enum { SCAN_BYTES = 1 << 17 };
+
+	/* Write value to data[0, n) as a job of sched_static
+
+	  For memory not touched yet (e.g. new without initialization),
+	  the OS places each page on the node of the thread first writing it,
+	  which is the thread doing that part in later jobs of sched_static
+	  or sched_affinity, with the same range and thread count.
+	*/
+	template <typename T>
+	void firstTouch(T* data, uint32_t n, T const& value);
 
 private:
+	template <typename T>
+	struct GK_ALIGNED(64) Padded {
+		T value;
+	};
+
+	/* Remaining range of one thread, except for sched_dynamic
+	  (end << 32) | start, so that both can be updated in one CAS.
+	  One cache line each, the owner and thieves only touch this line */
+	struct GK_ALIGNED(64) Share {
+		uint64_t range;
+		// For sched_auto, when and how large the last slice is taken
+		int64_t tick;
+		uint32_t slice;
+		// NUMA node of the thread
+		uint32_t node;
+	};
+
 	struct JobRef {
-		SyncPool* pool;
-		SyncJob* job;
+		/* Do slices on thread tid until nothing left,
+		  by SyncJob::call, or by the inlined body of parallel_for */
+		void (*run)(JobRef& ref, uint32_t tid);
+		// SyncJob, or body of parallel_for
+		void* job;
+		SyncJob::Schedule schedule;
 		uint32_t nstripe, maxcall;
 		uint32_t allstart, allend;
+		// Slice size of the own share
+		uint32_t stripe;
 		// Current index in range
 		uint32_t index;
-		// The number of threads on working
-		JobEvent event;
+		// For sched_auto, tuned slice size, and ticks of AUTO_SLICE_US
+		uint32_t grain;
+		int64_t target;
+		// Dynamic type of the job, the key of tuned grain
+		std::type_info const* type;
+		/* One per thread, of the pool when all threads work on it,
+		  otherwise `own` for the only thread */
+		Share* shares;
+		Share own;
+
+		JobRef(SyncJob::Schedule sched, uint32_t ncall, uint32_t start, uint32_t end);
+		// Assert all of the range has been done, after all threads have left
+		void check() const;
+		// Split the range for ntrd threads, 1 to take the whole range at once
+		void partition(uint32_t ntrd);
+		// Take a slice for thread tid, return false if nothing left
+		bool next(uint32_t tid, uint32_t& start, uint32_t& end);
+		bool nextShare(uint32_t tid, uint32_t& start, uint32_t& end);
+		bool nextAuto(uint32_t tid, uint32_t& start, uint32_t& end);
+		bool steal(uint32_t tid);
 
-		JobRef(SyncJob& job, uint32_t ntrd);
-		~JobRef();
-		void execute(uint32_t tid);
+		// run of SyncJob
+		static void call(JobRef& ref, uint32_t tid);
+
+		template <typename F>
+		static void loop(JobRef& ref, uint32_t tid)
+		{
+			F& body = *static_cast<F*>(ref.job);
+			for (uint32_t start, end; ref.next(tid, start, end);)
+				body(tid, start, end);
+		}
 	};
 
-	struct Worker {
+	// One cache line each at least
+	struct GK_ALIGNED(64) Worker {
 		uint32_t index, stop;
+		// The last epoch this worker has handled
+		uint32_t seen;
+		// Epoch this worker takes part in without others, UINT_MAX if none
+		uint32_t ticket;
 		SyncPool* pool;
 #if defined _WIN32
 		unsigned win32_id;
@@ -261,15 +1503,54 @@ private:
 #elif defined __linux__
 		pthread_t thread;
 #endif
-		JobLock lock;
-		JobCond cond;
-		std::shared_ptr<JobRef> ref;
+		WaitStat stat;
 	};
 
-	uint32_t num_worker;
-	Worker workers[MAX_THREAD - 1];
+	uint32_t num_worker, max_worker;
+	uint32_t spin_count;
+	/* Bit 0 set while a job is running, and 2 added by each setNumThread
+	  waiting or changing threads, submit does jobs alone unless 0 */
+	uint32_t busy;
+	// Of the main thread
+	WaitStat stat;
+	// max_worker and max_worker + 1 of them
+	AlignedArray<Worker> workers;
+	AlignedArray<Share> shares;
 	JobLock pool_lock;
 	JobCond pool_cond;
+	/* Workers wait for it with bit index % 32, woken by one futex call,
+	  all of them or those of a ticket */
+	JobEpoch epoch;
+	// Epoch all workers take part in, UINT_MAX if not
+	uint32_t all;
+	/* Job of current epoch, nullptr to only check in (for stopping).
+	  Not changed until all workers have left `event` */
+	JobRef* current;
+	// The number of workers not checked in for current epoch
+	JobEvent event;
+	// Tuned slice size of sched_auto of each job type, guarded by pool_lock
+	std::unordered_map<std::type_index, uint32_t> grains;
+	CpuTopology topo;
+	CpuAffinity affinity;
+	// CPU and node of each tid, empty if not pinned
+	std::vector<uint32_t> places, nodes;
+
+	// Publish ref to workers [begin, end), and wake them by one bump
+	void dispatch(JobRef* ref, uint32_t begin, uint32_t end);
+	// Wait for all workers checked in
+	void join();
+	// Place and pin threads by affinity on topo, pool_lock held
+	void applyAffinity();
+	// Do ref with as many threads as possible, and return
+	void launch(JobRef& ref);
+	// parallel_for, type is the key of tuned grain
+	template <typename F>
+	void launchFor(uint32_t begin, uint32_t end, F& body,
+		SyncJob::Schedule schedule, std::type_info const& type, uint32_t ncall = 0);
+	// parallel_for64, by blocks of SyncJob64
+	template <typename F>
+	void launchFor64(uint64_t begin, uint64_t end, F& body,
+		SyncJob::Schedule schedule, std::type_info const& type, uint32_t ncall);
 
 #if defined _WIN32
 	static unsigned __stdcall trdRoutine(void* void_args);
@@ -278,4 +1559,136 @@ private:
 #endif
 };
 
+template <typename F>
+void SyncPool::parallel_for(uint32_t begin, uint32_t end, F&& body,
+	SyncJob::Schedule schedule)
+{
+	launchFor(begin, end, body, schedule, typeid(F));
+}
+
+template <typename F>
+void SyncPool::parallel_for64(uint64_t begin, uint64_t end, F&& body,
+	SyncJob::Schedule schedule)
+{
+	launchFor64(begin, end, body, schedule, typeid(F), 0);
+}
+
+template <typename F>
+void SyncPool::launchFor(uint32_t begin, uint32_t end, F& body,
+	SyncJob::Schedule schedule, std::type_info const& type, uint32_t ncall)
+{
+	if (begin >= end)
+		return;
+	JobRef ref(schedule, ncall, begin, end);
+	ref.run = &JobRef::loop<F>;
+	ref.job = const_cast<void*>(static_cast<void const*>(&body));
+	ref.type = &type;
+	launch(ref);
+}
+
+template <typename F>
+void SyncPool::launchFor64(uint64_t begin, uint64_t end, F& body,
+	SyncJob::Schedule schedule, std::type_info const& type, uint32_t ncall)
+{
+	if (begin >= end)
+		return;
+	/* Block b starts at q * b + r * b / nblock, where r * b < 2^62.
+	  Blocks are single indices if the range is short */
+	uint64_t range = end - begin;
+	uint32_t nblock = static_cast<uint32_t>(min(range, static_cast<uint64_t>(SyncJob64::MAX_BLOCK)));
+	uint64_t q = range / nblock, r = range % nblock;
+	auto blocks = [&](uint32_t tid, uint32_t start, uint32_t stop) {
+		body(tid, begin + q * start + r * start / nblock,
+			begin + q * stop + r * stop / nblock);
+	};
+	launchFor(0, nblock, blocks, schedule, type, ncall);
+}
+
+template <typename T, typename Body, typename Combine>
+T SyncPool::reduce(uint32_t begin, uint32_t end, T const& init,
+	Body&& body, Combine&& combine, bool deterministic,
+	SyncJob::Schedule schedule)
+{
+	if (begin >= end)
+		return init;
+	uint32_t range = end - begin;
+	uint32_t nacc = deterministic
+		? min(range, static_cast<uint32_t>(REDUCE_BLOCK))
+		: getMaxThread();
+	AlignedArray<Padded<T>> acc(nacc, Padded<T> {init});
+	if (deterministic) {
+		parallel_for(0, nacc, [&](uint32_t, uint32_t start, uint32_t stop) {
+			for (uint32_t i = start; i < stop; ++i) {
+				uint32_t lo = begin + static_cast<uint32_t>(static_cast<uint64_t>(range) * i / nacc);
+				uint32_t hi = begin + static_cast<uint32_t>(static_cast<uint64_t>(range) * (i + 1) / nacc);
+				body(acc[i].value, lo, hi);
+			}
+		}, schedule);
+	} else {
+		parallel_for(begin, end, [&](uint32_t tid, uint32_t start, uint32_t stop) {
+			body(acc[tid].value, start, stop);
+		}, schedule);
+	}
+	for (uint32_t step = 1; step < nacc; step *= 2u) {
+		for (uint32_t i = 0; i + step < nacc; i += 2u * step)
+			combine(acc[i].value, static_cast<T const&>(acc[i + step].value));
+	}
+	return acc[0].value;
+}
+
+template <typename T>
+void SyncPool::firstTouch(T* data, uint32_t n, T const& value)
+{
+	parallel_for(0, n, [&](uint32_t, uint32_t start, uint32_t end) {
+		for (uint32_t i = start; i < end; ++i)
+			data[i] = value;
+	}, SyncJob::sched_static);
+}
+
+template <typename T, typename Op>
+void SyncPool::scan(T const* in, T* out, uint32_t n, T const& init,
+	Op&& op, bool inclusive)
+{
+	if (!n)
+		return;
+	uint32_t block = max(static_cast<uint32_t>(SCAN_BYTES / sizeof(T)), 1u);
+	uint32_t nblock = (n - 1u) / block + 1u;
+	// Sum of each block, then in-place exclusive scan of them
+	std::vector<T> carry(nblock, init);
+	parallel_for(0, nblock, [&](uint32_t, uint32_t start, uint32_t stop) {
+		for (uint32_t b = start; b < stop; ++b) {
+			T const* src = in + static_cast<size_t>(b) * block;
+			uint32_t len = min(block, n - b * block);
+			T acc = src[0];
+			for (uint32_t i = 1; i < len; ++i)
+				acc = op(acc, src[i]);
+			carry[b] = acc;
+		}
+	});
+	T acc = init;
+	for (uint32_t b = 0; b < nblock; ++b) {
+		T sum = op(acc, carry[b]);
+		carry[b] = acc;
+		acc = sum;
+	}
+	parallel_for(0, nblock, [&](uint32_t, uint32_t start, uint32_t stop) {
+		for (uint32_t b = start; b < stop; ++b) {
+			T const* src = in + static_cast<size_t>(b) * block;
+			T* dst = out + static_cast<size_t>(b) * block;
+			uint32_t len = min(block, n - b * block);
+			T val = carry[b];
+			if (inclusive) {
+				for (uint32_t i = 0; i < len; ++i)
+					dst[i] = val = op(val, src[i]);
+			} else {
+				for (uint32_t i = 0; i < len; ++i) {
+					T cur = src[i];
+					dst[i] = val;
+					val = op(val, cur);
+				}
+			}
+		}
+	});
+}
+
 }
@@ -145,8 +145,25 @@ public:
 		return *this;
 	}
 
+	// Give up the reference without releasing it
+	T* release() noexcept
+	{
+		T* ptr = obj;
+		obj = nullptr;
+		return ptr;
+	}
+
+	// Take a reference given up by release
+	static RefPtr adopt(T* ptr) noexcept
+	{
+		RefPtr r;
+		r.obj = ptr;
+		return r;
+	}
+
 	T* get() const noexcept { return obj; }
 	T* operator->() const noexcept { return obj; }
+	T& operator*() const noexcept { return *obj; }
 	explicit operator bool() const noexcept { return static_cast<bool>(obj); }
 
 	template <typename U>
@@ -0,0 +1,305 @@
+﻿#include "topology.hpp"
+#include <algorithm>
+#include <cstring>
+#if defined __linux__
+#	include <sched.h>
+#	include <dirent.h>
+#endif
+
+namespace gk {
+
+#if defined __linux__
+
+// An integer in /sys/devices/system/cpu/cpu<cpu>/topology/, -1 if unknown
+static int readSysTopology(uint32_t cpu, char const* name)
+{
+	char path[96];
+	snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%u/topology/%s", cpu, name);
+	FILE* fid = fopen(path, "r");
+	if (!fid)
+		return -1;
+	int val = -1;
+	if (fscanf(fid, "%d", &val) != 1)
+		val = -1;
+	fclose(fid);
+	return val;
+}
+
+/* Node of each CPU from /sys/devices/system/node/node<n>/cpulist,
+  e.g. "0-3,8-11", 0 if there is no such directory */
+static void readSysNode(std::vector<uint32_t>& node)
+{
+	DIR* dir = opendir("/sys/devices/system/node");
+	if (!dir)
+		return;
+	for (dirent* ent; (ent = readdir(dir));) {
+		unsigned n = 0;
+		if (sscanf(ent->d_name, "node%u", &n) != 1)
+			continue;
+		char path[96];
+		snprintf(path, sizeof(path), "/sys/devices/system/node/node%u/cpulist", n);
+		FILE* fid = fopen(path, "r");
+		if (!fid)
+			continue;
+		unsigned lo = 0, hi = 0;
+		for (int ret; (ret = fscanf(fid, "%u-%u", &lo, &hi)) >= 1;) {
+			if (ret == 1)
+				hi = lo;
+			for (unsigned i = lo; i <= hi && i < node.size(); ++i)
+				node[i] = n;
+			if (fgetc(fid) != ',')
+				break;
+		}
+		fclose(fid);
+	}
+	closedir(dir);
+}
+
+#endif
+
+// Replace values of field by their ranks of all distinct values
+template <typename F>
+static void numberDensely(std::vector<CpuInfo>& cpus, F field)
+{
+	std::vector<uint32_t> vals;
+	for (CpuInfo& cpu : cpus)
+		vals.push_back(field(cpu));
+	std::sort(vals.begin(), vals.end());
+	vals.erase(std::unique(vals.begin(), vals.end()), vals.end());
+	for (CpuInfo& cpu : cpus) {
+		uint32_t& val = field(cpu);
+		val = static_cast<uint32_t>(
+			std::lower_bound(vals.begin(), vals.end(), val) - vals.begin());
+	}
+}
+
+static CpuTopology readTopology()
+{
+	// Fill with core and package of OS first, numbered densely at last
+	CpuTopology topo;
+#if defined _WIN32
+	DWORD_PTR proc_mask = 0, sys_mask = 0;
+	GK_ASSERT(GetProcessAffinityMask(GetCurrentProcess(), &proc_mask, &sys_mask));
+	uint32_t const nbit = sizeof(DWORD_PTR) * 8;
+	std::vector<CpuInfo> all(nbit);
+	for (uint32_t i = 0; i < nbit; ++i)
+		all[i] = CpuInfo {i, i, 0, 0};
+	DWORD len = 0;
+	GetLogicalProcessorInformation(NULL, &len);
+	std::vector<SYSTEM_LOGICAL_PROCESSOR_INFORMATION> info(
+		len / sizeof(SYSTEM_LOGICAL_PROCESSOR_INFORMATION));
+	if (!info.empty() && GetLogicalProcessorInformation(info.data(), &len)) {
+		uint32_t ncore = 0, npackage = 0;
+		for (auto const& it : info) {
+			if (it.Relationship != RelationProcessorCore
+				&& it.Relationship != RelationProcessorPackage
+				&& it.Relationship != RelationNumaNode)
+				continue;
+			for (uint32_t i = 0; i < nbit; ++i) {
+				if (!((it.ProcessorMask >> i) & 1u))
+					continue;
+				if (it.Relationship == RelationProcessorCore)
+					all[i].core = ncore;
+				else if (it.Relationship == RelationProcessorPackage)
+					all[i].package = npackage;
+				else
+					all[i].node = static_cast<uint32_t>(it.NumaNode.NodeNumber);
+			}
+			if (it.Relationship == RelationProcessorCore)
+				++ncore;
+			else if (it.Relationship == RelationProcessorPackage)
+				++npackage;
+		}
+	}
+	for (uint32_t i = 0; i < nbit; ++i) {
+		if ((proc_mask >> i) & 1u)
+			topo.cpus.push_back(all[i]);
+	}
+#elif defined __linux__
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	GK_ASSERT(!sched_getaffinity(0, sizeof(set), &set));
+	std::vector<uint32_t> node(CPU_SETSIZE, 0);
+	readSysNode(node);
+	for (uint32_t i = 0; i < CPU_SETSIZE; ++i) {
+		if (!CPU_ISSET(i, &set))
+			continue;
+		// core_id is unique only in its package
+		int core = readSysTopology(i, "core_id");
+		int package = readSysTopology(i, "physical_package_id");
+		CpuInfo cpu;
+		cpu.id = i;
+		cpu.core = core < 0 ? i : static_cast<uint32_t>(core);
+		cpu.package = package < 0 ? 0 : static_cast<uint32_t>(package);
+		cpu.node = node[i];
+		topo.cpus.push_back(cpu);
+	}
+#endif
+	GK_ASSERT(!topo.cpus.empty());
+	numberDensely(topo.cpus, [](CpuInfo& cpu) -> uint32_t& { return cpu.node; });
+	numberDensely(topo.cpus, [](CpuInfo& cpu) -> uint32_t& { return cpu.package; });
+	std::sort(topo.cpus.begin(), topo.cpus.end(),
+		[](CpuInfo const& a, CpuInfo const& b) {
+			if (a.node != b.node)
+				return a.node < b.node;
+			if (a.package != b.package)
+				return a.package < b.package;
+			if (a.core != b.core)
+				return a.core < b.core;
+			return a.id < b.id;
+		});
+	uint32_t core = 0;
+	CpuInfo prev = {0, 0, 0, 0};
+	for (size_t i = 0; i < topo.cpus.size(); ++i) {
+		CpuInfo& cpu = topo.cpus[i];
+		if (i && (cpu.node != prev.node || cpu.package != prev.package
+				|| cpu.core != prev.core))
+			++core;
+		prev = cpu;
+		cpu.core = core;
+	}
+	return topo;
+}
+
+uint32_t CpuTopology::numNode() const
+{
+	uint32_t n = 0;
+	for (CpuInfo const& cpu : cpus)
+		n = max(n, cpu.node + 1u);
+	return max(n, 1u);
+}
+
+uint32_t CpuTopology::nodeOf(uint32_t id) const
+{
+	for (CpuInfo const& cpu : cpus) {
+		if (cpu.id == id)
+			return cpu.node;
+	}
+	return 0;
+}
+
+CpuTopology const& CpuTopology::system()
+{
+	static CpuTopology topo = [] {
+		char const* desc = getenv("GK_FAKE_TOPOLOGY");
+		return desc && *desc ? parse(desc) : readTopology();
+	}();
+	return topo;
+}
+
+CpuTopology CpuTopology::parse(char const* desc)
+{
+	unsigned nnode = 0, ncore = 0, nsmt = 0;
+	if (sscanf(desc, "%ux%ux%u", &nnode, &ncore, &nsmt) != 3
+		|| !nnode || !ncore || !nsmt || nnode * ncore * nsmt > 65536)
+		GK_LOG_ERROR("bad topology \"%s\", should be like 2x8x2\n", desc);
+	CpuTopology topo;
+	topo.fake = true;
+	for (uint32_t n = 0; n < nnode; ++n) {
+		for (uint32_t c = 0; c < ncore; ++c) {
+			for (uint32_t s = 0; s < nsmt; ++s) {
+				uint32_t core = n * ncore + c;
+				topo.cpus.push_back(CpuInfo {s * nnode * ncore + core, core, n, n});
+			}
+		}
+	}
+	return topo;
+}
+
+std::vector<uint32_t> CpuAffinity::place(CpuTopology const& topo) const
+{
+	std::vector<uint32_t> ids;
+	if (policy == affinity_none)
+		return ids;
+	if (policy == affinity_list) {
+		GK_ASSERT(!cpus.empty());
+		for (uint32_t id : cpus) {
+			auto it = std::find_if(topo.cpus.begin(), topo.cpus.end(),
+				[id](CpuInfo const& cpu) { return cpu.id == id; });
+			if (it == topo.cpus.end())
+				GK_LOG_ERROR("cpu %u is not allowed for this process\n", id);
+		}
+		return cpus;
+	}
+	if (policy != affinity_compact && policy != affinity_scatter
+		&& policy != affinity_core)
+		GK_LOG_ERROR("unknown affinity policy %u\n", static_cast<unsigned>(policy));
+
+	/* Index of each CPU in its core, and of its core in the domain,
+	  a domain is a package in a node, or a node in a package */
+	struct Rank {
+		uint32_t sibling, core, index;
+	};
+	std::vector<Rank> ranks;
+	uint32_t sibling = 0, core = 0;
+	for (size_t i = 0; i < topo.cpus.size(); ++i) {
+		CpuInfo const& cpu = topo.cpus[i];
+		if (!i || cpu.node != topo.cpus[i - 1].node
+			|| cpu.package != topo.cpus[i - 1].package)
+			sibling = core = 0;
+		else if (cpu.core != topo.cpus[i - 1].core)
+			sibling = 0, ++core;
+		else
+			++sibling;
+		ranks.push_back(Rank {sibling, core, static_cast<uint32_t>(i)});
+	}
+	// Already compact, as topo is sorted
+	if (policy == affinity_core) {
+		std::stable_sort(ranks.begin(), ranks.end(),
+			[](Rank const& a, Rank const& b) { return a.sibling < b.sibling; });
+	} else if (policy == affinity_scatter) {
+		std::stable_sort(ranks.begin(), ranks.end(),
+			[](Rank const& a, Rank const& b) {
+				if (a.sibling != b.sibling)
+					return a.sibling < b.sibling;
+				return a.core < b.core;
+			});
+	}
+	for (Rank const& r : ranks)
+		ids.push_back(topo.cpus[r.index].id);
+	return ids;
+}
+
+ThreadHandle currentThread()
+{
+#if defined _WIN32
+	return reinterpret_cast<ThreadHandle>(GetCurrentThread());
+#elif defined __linux__
+	return pthread_self();
+#endif
+}
+
+void pinThread(ThreadHandle thread, uint32_t cpu)
+{
+	CpuTopology const& topo = CpuTopology::system();
+#if defined _WIN32
+	uint32_t const nbit = sizeof(DWORD_PTR) * 8;
+	DWORD_PTR mask = 0;
+	if (cpu == UINT_MAX) {
+		for (CpuInfo const& it : topo.cpus)
+			mask |= static_cast<DWORD_PTR>(1) << it.id;
+	} else {
+		GK_ASSERT(cpu < nbit);
+		mask = static_cast<DWORD_PTR>(1) << cpu;
+	}
+	if (!SetThreadAffinityMask(reinterpret_cast<HANDLE>(thread), mask)) {
+		GK_LOG_ERROR("can not pin thread to cpu %u, err = %u\n",
+			cpu, static_cast<unsigned>(GetLastError()));
+	}
+#elif defined __linux__
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	if (cpu == UINT_MAX) {
+		for (CpuInfo const& it : topo.cpus)
+			CPU_SET(it.id, &set);
+	} else {
+		GK_ASSERT(cpu < CPU_SETSIZE);
+		CPU_SET(cpu, &set);
+	}
+	int err = pthread_setaffinity_np(thread, sizeof(set), &set);
+	if (err)
+		GK_LOG_ERROR("can not pin thread to cpu %u, err %s\n", cpu, strerror(err));
+#endif
+}
+
+}
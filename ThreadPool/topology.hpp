@@ -0,0 +1,94 @@
+﻿#pragma once
+#include "fwd.hpp"
+#include <utility>
+#include <vector>
+
+namespace gk {
+
+/* Logical CPU */
+struct CpuInfo {
+	// Index of OS, as in sched_setaffinity or SetThreadAffinityMask
+	uint32_t id;
+	// Physical core, SMT siblings have the same one, unique over packages
+	uint32_t core;
+	// Socket
+	uint32_t package;
+	// NUMA node, numbered densely in the order of OS
+	uint32_t node;
+};
+
+/* CPUs this process is allowed to run on, sorted by (node, package, core, id) */
+struct CpuTopology {
+	std::vector<CpuInfo> cpus;
+	// Described by `parse`, threads are grouped by it but never pinned
+	bool fake;
+
+	CpuTopology()
+		: fake(false) { }
+
+	uint32_t numNode() const;
+	// Node of CPU id, 0 if not in cpus
+	uint32_t nodeOf(uint32_t id) const;
+
+	/* Read once, on Linux from /sys/devices/system/cpu and
+	  /sys/devices/system/node, on Windows by GetLogicalProcessorInformation.
+	  If nothing is known, each CPU is a core of package 0 and node 0.
+	  If environment variable GK_FAKE_TOPOLOGY is set, it is parsed instead */
+	static CpuTopology const& system();
+
+	/* Fake topology for testing, "<nodes>x<cores per node>x<threads per core>"
+	  e.g. "2x8x2". One package per node, SMT siblings numbered as Linux,
+	  i.e. the first threads of all cores, then the second ones */
+	static CpuTopology parse(char const* desc);
+};
+
+/* Where threads of a pool run
+
+Thread i runs on place[i % place.size()].
+  - affinity_none    : leave it to OS, the default
+  - affinity_compact : fill a core with SMT siblings, then the next core,
+      then the next package and node. Threads share caches most
+  - affinity_scatter : one core of each node (and package) in turn,
+      SMT siblings are used after all cores. Most caches and memory bandwidth
+  - affinity_core    : one thread per physical core, package by package,
+      SMT siblings are used after all cores
+  - affinity_list    : `cpus`, in the given order
+*/
+struct CpuAffinity {
+	enum Policy : uint32_t {
+		affinity_none = 0,
+		affinity_compact,
+		affinity_scatter,
+		affinity_core,
+		affinity_list,
+	};
+
+	Policy policy;
+	// IDs of OS, only for affinity_list
+	std::vector<uint32_t> cpus;
+
+	CpuAffinity(Policy p = affinity_none)
+		: policy(p) { }
+	CpuAffinity(std::vector<uint32_t> list)
+		: policy(affinity_list), cpus(std::move(list)) { }
+
+	/* IDs of CPU for thread 0, 1, ..., empty for affinity_none
+	  All of `cpus` must be in topo */
+	std::vector<uint32_t> place(CpuTopology const& topo) const;
+};
+
+#if defined _WIN32
+typedef uintptr_t ThreadHandle;
+#elif defined __linux__
+typedef pthread_t ThreadHandle;
+#endif
+
+ThreadHandle currentThread();
+
+/* Bind thread to one CPU, or to all of CpuTopology::system() if UINT_MAX
+
+  On Windows, only the first 64 CPUs (processor group 0) are supported.
+*/
+void pinThread(ThreadHandle thread, uint32_t cpu);
+
+}